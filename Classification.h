@@ -46,17 +46,18 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         }
 
         // Calculates the change in entropy (entropy defined for HistogramAggregator 
-        // as Shannon entropy)
+        // as Shannon entropy). Uses the count weighted entropies, which come
+        // from the n log2 n table rather than a log per bin.
         double ComputeInformationGain(const HistogramAggregator& allStatistics, const HistogramAggregator& leftStatistics, const HistogramAggregator& rightStatistics)
         {
-            double entropyBefore = allStatistics.Entropy();
-
             unsigned int nTotalSamples = leftStatistics.SampleCount() + rightStatistics.SampleCount();
 
             if (nTotalSamples <= 1)
                 return 0.0;
 
-            double entropyAfter = (leftStatistics.SampleCount() * leftStatistics.Entropy() + rightStatistics.SampleCount() * rightStatistics.Entropy()) / nTotalSamples;
+            double entropyBefore = allStatistics.SampleCount() == 0 ? 0.0 : allStatistics.WeightedEntropy() / allStatistics.SampleCount();
+
+            double entropyAfter = (leftStatistics.WeightedEntropy() + rightStatistics.WeightedEntropy()) / nTotalSamples;
 
             return entropyBefore - entropyAfter;
         }
@@ -65,6 +66,47 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         {
             return gain < 0.01;
         }
+
+        // Entropy gain is at most the entropy of a uniform histogram
+        double GainRange()
+        {
+            return nClasses_ > 1 ? log2((double)nClasses_) : 0.0;
+        }
+    };
+
+    /// <summary>
+    /// Classification training context that splits on the reduction in Gini
+    /// impurity rather than entropy. Gain comes from integer sums of squared
+    /// counts, with no logs.
+    /// </summary>
+    template<class F>
+    class GiniClassificationTrainingContext : public ClassificationTrainingContext<F> // where F:IFeatureResponse
+    {
+    public:
+        GiniClassificationTrainingContext(int nClasses, IFeatureResponseFactory<F>* featureFactory)
+            : ClassificationTrainingContext<F>(nClasses, featureFactory)
+        {
+        }
+
+    private:
+        double ComputeInformationGain(const HistogramAggregator& allStatistics, const HistogramAggregator& leftStatistics, const HistogramAggregator& rightStatistics)
+        {
+            unsigned int nTotalSamples = leftStatistics.SampleCount() + rightStatistics.SampleCount();
+
+            if (nTotalSamples <= 1)
+                return 0.0;
+
+            double giniBefore = allStatistics.SampleCount() == 0 ? 0.0 : allStatistics.WeightedGini() / allStatistics.SampleCount();
+
+            double giniAfter = (leftStatistics.WeightedGini() + rightStatistics.WeightedGini()) / nTotalSamples;
+
+            return giniBefore - giniAfter;
+        }
+
+        double GainRange()
+        {
+            return 1.0;
+        }
     };
 
     /// <summary>
@@ -80,26 +122,38 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         /// Create and train a classification forest (HistogramAggregator statistics) 
         /// If OpenMP is compiled, this function parallelises by evaluating node responses in parallel
         /// training one tree at a time.
+        /// If a checkpoint is given, finished trees are resumed from and
+        /// saved to it (see ForestCheckpoint).
         /// </summary>
         static std::unique_ptr<Forest<F, HistogramAggregator> > TrainPar(
             const DataPointCollection& trainingData,
-            const TrainingParameters& TrainingParameters) // where F : IFeatureResponse
+            const TrainingParameters& TrainingParameters,
+            ForestCheckpoint<F, HistogramAggregator>* checkpoint = 0) // where F : IFeatureResponse
         {
 
             if (trainingData.HasLabels() == false)
                 throw std::runtime_error("Training data points must be labelled.");
 
-            // For random number generation.
-            Random random;
+            // For random number generation. Every tree, node and feature
+            // gets its own stream derived from this seed.
+            Random random = TrainingParameters.RandomSeed < 0 ? Random() : Random(TrainingParameters.RandomSeed);
 
             FeatureFactory<F> featureFactory(trainingData.Dimensions());
-            ClassificationTrainingContext<F> classificationContext(trainingData.CountClasses(), &featureFactory);
+            ClassificationTrainingContext<F> entropyContext(trainingData.CountClasses(), &featureFactory);
+            GiniClassificationTrainingContext<F> giniContext(trainingData.CountClasses(), &featureFactory);
+            ClassificationTrainingContext<F>& classificationContext = TrainingParameters.SplitCriterion == SplitCriterionDescriptor::Gini ?
+                giniContext : entropyContext;
             ProgressStream progress_stream(std::cout, Interest);
             if (TrainingParameters.Verbose)
                 progress_stream.makeVerbose();
+            progress_stream[Interest] << "Random seed: " << random.Key() << std::endl;
+
+            // Trees train on whole-image bags of the shared data, if asked
+            ImageBagSampler sampler(trainingData, TrainingParameters.BagFraction, TrainingParameters.BagBootstrap);
 
             std::unique_ptr<Forest<F, HistogramAggregator> > forest = ParallelForestTrainer<F, HistogramAggregator>::TrainForest(
-                random, TrainingParameters, classificationContext, trainingData, &progress_stream);
+                random, TrainingParameters, classificationContext, trainingData, &progress_stream,
+                TrainingParameters.Bagging() ? &sampler : 0, checkpoint);
 
             return forest;
         }
@@ -1,5 +1,8 @@
 #include "DataPointCollection.h"
 
+#include <cstdio>
+#include <cstring>
+
 namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 {
     // Iterares through a depth image (16 bit uint) and classifies each pixel 
@@ -28,48 +31,133 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         return label_mat;
     }
 
-    // Load up some images from path specified in the program parameters
-    // If it's a classifiaction forest, or a full-spread regressor, and we're 
-    // training on a zero IR input, we don't need to keep an index of all 
-    // pixel locations, they can be calculated on-the-fly. This is referred to
-    // as the "low memory" implementation in this case.
-    std::unique_ptr<DataPointCollection> DataPointCollection::LoadImages(
-        ProgramParameters& progParams, bool classification, int class_number)
+    // Chooses k of the candidate pixels, spread as evenly as possible over
+    // the depth bins they fall in. Bins with fewer candidates than their
+    // share give the remainder to the larger bins. The chosen pixels are
+    // returned in ascending order.
+    void stratifiedSample(std::vector<std::vector<uint32_t> >& bin_pixels, int k,
+        Random& random, std::vector<uint32_t>& chosen)
     {
-        std::string prefix = progParams.InputPrefix;
-        cv::Size img_size = cv::Size(progParams.ImgWidth, progParams.ImgHeight);
-        
-        // for shorthand
-        std::string path = progParams.TrainingImagesPath;
-        if (!IPUtils::dirExists(path))
-            throw std::runtime_error("Failed to find directory:\t" + path);
+        chosen.clear();
 
+        // Visit the smallest bins first so their unused share can be
+        // passed on to the ones after
+        std::vector<int> order;
+        for (int b = 0; b < (int)bin_pixels.size(); b++)
+            if (!bin_pixels[b].empty())
+                order.push_back(b);
+        std::sort(order.begin(), order.end(), [&bin_pixels](int a, int b)
+            { return bin_pixels[a].size() < bin_pixels[b].size(); });
+
+        int remaining = k;
+        for (int o = 0; o < (int)order.size(); o++)
+        {
+            std::vector<uint32_t>& pixels = bin_pixels[order[o]];
+            int n = pixels.size();
+            int take = std::min(n, remaining / (int)(order.size() - o));
+
+            // Partial Fisher-Yates shuffle, keeping the first take
+            for (int i = 0; i < take; i++)
+                std::swap(pixels[i], pixels[random.Next(i, n)]);
+            chosen.insert(chosen.end(), pixels.begin(), pixels.begin() + take);
+            remaining -= take;
+        }
+
+        std::sort(chosen.begin(), chosen.end());
+    }
+
+    // Reads training image pair file_no from the path in the program
+    // parameters, checks it and preprocesses the IR image. Returns false if
+    // the pair is missing or filtered out and should be skipped.
+    bool readTrainingImages(ProgramParameters& progParams, int file_no, const std::vector<int>& pixel_labels,
+        cv::Mat& ir_preprocessed, cv::Mat& depth_image, cv::Mat& depth_labels)
+    {
+        std::string ir_path_suffix = progParams.Webcam? "cam.png" : "ir.png";
+
+        // generate individual image paths
+        std::string ir_path = progParams.TrainingImagesPath + progParams.InputPrefix + std::to_string(file_no) + ir_path_suffix;
+        std::string depth_path = progParams.TrainingImagesPath + progParams.InputPrefix + std::to_string(file_no) + "depth.png";
+
+        // read depth and ir images
+        cv::Mat ir_image = cv::imread(ir_path, -1);
+        depth_image = cv::imread(depth_path, -1);
+
+        // if program fails to open image
+        if(!ir_image.data)
+        {
+            std::cerr << "Failed to open image:\n\t" + ir_path << std::endl;
+            return false;
+        }
+        if (!depth_image.data)
+        {
+            std::cerr << "Failed to open image:\n\t" + depth_path << std::endl;
+            return false;
+        }
+        // If the datatypes in the images are incorrect
+        if (IPUtils::getTypeString(ir_image.type()) != "8UC1")
+            throw std::runtime_error("Encountered image with unexpected content type:\n\t" + ir_path);
+
+        if (IPUtils::getTypeString(depth_image.type()) != "16UC1")
+            throw std::runtime_error("Encountered image with unexpected content type:\n\t" + depth_path);
+
+        if (ir_image.size() != depth_image.size())
+            throw std::runtime_error("Depth and IR images not the same size:\n\t" + ir_path + depth_path);
+
+        // Create matrix of depth labels (ie depth bins)
+        depth_labels = createLabelMatrix(depth_image, pixel_labels);
+        if(!progParams.Closeup)
+        {
+            int tallest_bin = IPUtils::getTallestBin(depth_labels);
+            if(tallest_bin == 1)
+                return false;
+        }
+
+        // Send the ir image for preprocessing, default values used for now
+        ir_preprocessed = IPUtils::preProcess(ir_image, progParams.Threshold);
+        return true;
+    }
+
+    // Appends an image's pixels to a shard or cache file. Images stored
+    // this way are all read back at the parameters' image size.
+    void writeImage(std::ofstream& out, const cv::Mat& image, cv::Size img_size)
+    {
+        if (image.size() != img_size)
+            throw std::runtime_error("Image size doesn't match IMG_WIDTH and IMG_HEIGHT");
+        for (int r = 0; r < image.rows; r++)
+            out.write((const char*)image.ptr<uchar>(r), image.cols);
+    }
+
+    std::unique_ptr<DataPointCollection> DataPointCollection::Create(
+        ProgramParameters& progParams, bool classification, int class_number)
+    {
         if (progParams.PatchSize % 2 == 0)
             throw std::runtime_error("Patch size must be odd");
-        
-        int number = progParams.NumberTrainingImages;
-        int first = progParams.TrainingImagesStart;
-        int last = first + number -1;
 
-        // Set up DataPointCollection object
         std::unique_ptr<DataPointCollection> result = std::unique_ptr<DataPointCollection>(new DataPointCollection());
+        result->classification_ = classification;
+        result->class_number_ = class_number;
         
         // the result dimension here is interpreted differently depending on
         // the split function... it's bad design but it comes back to the 
         // Sherwood "interfaces".
-        if(progParams.SplitFunctionType == SplitFunctionDescriptor::PixelDifference)
+        // Pixel and box differences both span the whole patch.
+        if(progParams.SplitFunctionType == SplitFunctionDescriptor::PixelDifference ||
+            progParams.SplitFunctionType == SplitFunctionDescriptor::BoxDifference)
             result->dimension_ = progParams.PatchSize * progParams.PatchSize;
         else
             result->dimension_ = progParams.PatchSize;
 
         result->depth_raw = progParams.DepthRaw;
-        result->image_size = img_size;
-        result->step = img_size.height * img_size.width;
-        result->data_vec_size = (uint32_t)(number * img_size.height * img_size.width);
+        result->SetImageSize(cv::Size(progParams.ImgWidth, progParams.ImgHeight));
+        // When sampling pixels, at most PixelsPerImage are kept from each image
+        result->pixels_per_image_ = std::min(progParams.PixelsPerImage, result->step);
+        int per_image = result->pixels_per_image_ > 0 ? result->pixels_per_image_ : result->step;
+        result->data_vec_size = (uint32_t)(progParams.NumberTrainingImages * per_image);
         // For classification, always use the low memory implementation because there's no need
-        // to filter by bins.
+        // to filter by bins. Sampled pixels always need their indices kept.
         result->train_on_zero = progParams.TrainOnZeroIR;
-        if(progParams.TrainOnZeroIR && (classification||class_number == -1))
+        bool sample_pixels = result->pixels_per_image_ > 0;
+        if(progParams.TrainOnZeroIR && (classification||class_number == -1) && !sample_pixels)
         {
             result->low_memory = true;
         }
@@ -78,187 +166,678 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
             result->low_memory = false;
         }
 
-        // If it's not a low memory implementation, we need a data vector
-        // to hold the valid pixel indices.
-        if(!(result->low_memory))
-        {
-            result->data_.resize(result->data_vec_size);
-        }
-
-        // Save integer labels for classifier, target values for regressor
-        if(classification) 
-        {
-            result->labels_.resize(result->data_vec_size);
-        }
-        else
-        {
-            result->targets_.resize(result->data_vec_size);
-        }
-
-        result->images_.resize(number);
-        int img_no = 0;
-        int label_no = 0;
-        int target_no = 0;
-        int datum_no = 0;
-
-        // Variables affecting class formation
-        bool zero_class = true;
-        int total_classes = progParams.Bins;
-        int max_range = progParams.MR;
         // This max parameter is important. Don't forget this is aimed at 16 bit unsigned ints, 
         // so the viable range is 0-65535. 
         // If not using RAW depth data format, it's measured in mm, so be sensible (i.e. 1000 - 1500 mm?)
-        int max = progParams.DepthRaw ? 65000 : max_range;
-        result->pixelLabels_ = IPUtils::generateDepthBinMap(true, total_classes, max);
-        cv::Mat ir_image, ir_preprocessed, depth_image, depth_labels;
+        int max = progParams.DepthRaw ? 65000 : progParams.MR;
+        result->pixelLabels_ = IPUtils::generateDepthBinMap(true, progParams.Bins, max);
 
-        std::string ir_path;
-        std::string depth_path;
-        cv::Size ir_size, depth_size;
+        // Each image's pixels are sampled from a stream keyed on its file
+        // number, so the same images give the same samples.
+        int seed = progParams.Tpc.RandomSeed;
+        result->sampling_key_ = (seed < 0 ? Random() : Random(seed)).Stream(PixelSamplingStream).Key();
 
-        std::string ir_path_suffix = progParams.Webcam? "cam.png" : "ir.png";
+        return result;
+    }
 
-        for (int i = first; i <= last;i++)
-        {
-            // generate individual image paths
-            ir_path = path + prefix + std::to_string(i) + ir_path_suffix;
-            depth_path = path + prefix + std::to_string(i) + "depth.png";
+    void DataPointCollection::ExtractImageDataPoints(int file_no, const cv::Mat& ir_preprocessed,
+        const cv::Mat& depth_image, const cv::Mat& depth_labels, ImageFragment& fragment) const
+    {
+        fragment.pixels.clear();
+        fragment.labels.clear();
+        fragment.targets.clear();
 
-            //std::cout << std::to_string(i) << std::endl;
-            // read depth and ir images
-            ir_image = cv::imread(ir_path, -1);
-            depth_image = cv::imread(depth_path, -1);
+        cv::Size depth_size = depth_image.size();
+        bool classification = classification_;
+        int class_number = class_number_;
 
-            // if program fails to open image
-            if(!ir_image.data)
-            {
-                std::cerr << "Failed to open image:\n\t" + ir_path << std::endl;
-                continue;
-            }
-            if (!depth_image.data)
+        // iterate through depth_labels matrix and add each element
+        // to results.
+        // Separated classification and regression out to try and
+        // reduce the number of if else clauses insize big for loops
+        if(pixels_per_image_ > 0)
+        {
+            // Gather the pixels which pass the same filters as below,
+            // by depth bin, then keep a stratified sample of them.
+            std::vector<std::vector<uint32_t> > bin_pixels(*std::max_element(pixelLabels_.begin(), pixelLabels_.end()) + 1);
+            for (int r = 0; r < depth_size.height; r++)
             {
-                std::cerr << "Failed to open image:\n\t" + depth_path << std::endl;
-                continue;
+                const uchar* label_pixel = depth_labels.ptr<uchar>(r);
+                const uchar* ir_pixel = ir_preprocessed.ptr<uchar>(r);
+                for (int c = 0; c < depth_size.width; c++)
+                {
+                    if(!train_on_zero && ir_pixel[c] == 0)
+                        continue;
+                    if(!classification && !(class_number == label_pixel[c] || class_number == -1))
+                        continue;
+                    bin_pixels[label_pixel[c]].push_back((r * image_size.width) + c);
+                }
             }
-            // If the datatypes in the images are incorrect
-            if (IPUtils::getTypeString(ir_image.type()) != "8UC1")
-                throw std::runtime_error("Encountered image with unexpected content type:\n\t" + ir_path);
 
-            if (IPUtils::getTypeString(depth_image.type()) != "16UC1")
-                throw std::runtime_error("Encountered image with unexpected content type:\n\t" + depth_path);
+            std::vector<uint32_t> chosen;
+            Random image_random = Random(sampling_key_).Stream(file_no);
+            stratifiedSample(bin_pixels, pixels_per_image_, image_random, chosen);
 
-            ir_size = ir_image.size();
-            depth_size = depth_image.size();
-            if (ir_size != depth_size)
-                throw std::runtime_error("Depth and IR images not the same size:\n\t" + ir_path + depth_path);
-
-            // Create matrix of depth labels (ie depth bins)
-            depth_labels = createLabelMatrix(depth_image, result->pixelLabels_);
-            if(!progParams.Closeup)
+            for (size_t p = 0; p < chosen.size(); p++)
             {
-                int tallest_bin = IPUtils::getTallestBin(depth_labels);
-                std::cout << std::to_string(tallest_bin) << std::endl;
-                if(tallest_bin == 1)
+                int r = chosen[p] / image_size.width;
+                int c = chosen[p] % image_size.width;
+                if(classification)
+                    fragment.labels.push_back(depth_labels.at<uchar>(r, c));
+                else
+                    fragment.targets.push_back(depth_image.at<uint16_t>(r, c));
+                fragment.pixels.push_back(chosen[p]);
+            }
+        }
+        else if(classification)
+        {
+            for (int r = 0; r < depth_size.height; r++)
+            {
+                const uchar* label_pixel = depth_labels.ptr<uchar>(r);
+                const uchar* ir_pixel = ir_preprocessed.ptr<uchar>(r);
+                for (int c = 0; c < depth_size.width; c++)
                 {
-                    continue;
+                    if(train_on_zero)
+                    {
+                        fragment.labels.push_back(label_pixel[c]);
+                    }
+                    else
+                    {
+                        if(ir_pixel[c] != 0)
+                        {
+                            fragment.labels.push_back(label_pixel[c]);
+                            fragment.pixels.push_back((r * image_size.width) + c);
+                        }
+                    }
                 }
             }
-
-            // Send the ir image for preprocessing, default values used for now
-            ir_preprocessed = IPUtils::preProcess(ir_image, progParams.Threshold);
-            result->images_[img_no] = ir_preprocessed;
-
-            
-            // iterate through depth_labels matrix and add each element
-            // to results.
-            // Separated classification and regression out to try and
-            // reduce the number of if else clauses insize big for loops
-            if(classification)
+        }
+        else
+        {
+            // Regression, iterate through pixels, 
+            // If pixel's in correct depth bin, add to targets vector
+            // If not training on zero IR, then skip zero IR values
+            // If not using low memory, add index to data vector
+            for (int r = 0; r < depth_size.height; r++)
             {
-                for (int r = 0; r < depth_size.height; r++)
+                const uint16_t* depth_pixel = depth_image.ptr<uint16_t>(r);
+                const uchar* label_pixel = depth_labels.ptr<uchar>(r);
+                const uchar* ir_pixel = ir_preprocessed.ptr<uchar>(r);
+                for (int c = 0; c < depth_size.width; c++)
                 {
-                    uchar* label_pixel = depth_labels.ptr<uchar>(r);
-                    uchar* ir_pixel = ir_preprocessed.ptr<uchar>(r);
-                    for (int c = 0; c < depth_size.width; c++)
+                    if (class_number == label_pixel[c] || class_number == -1)
                     {
-                        if(result->train_on_zero)
+                        // if training on zero, always add depth target, 
+                        // Add index if not low memory implementation
+                        // If not training on zero IR input, add to targets
+                        // and also add index to data vector.
+                        if(train_on_zero)
                         {
-                            result->labels_[label_no] = label_pixel[c];
-                            label_no++;
+                            fragment.targets.push_back(depth_pixel[c]);
+                            if(!low_memory)
+                                fragment.pixels.push_back((r * image_size.width) + c);
                         }
                         else
                         {
                             if(ir_pixel[c] != 0)
                             {
-                                result->labels_[label_no] = label_pixel[c];
-                                label_no++;       
-                                result->data_[datum_no] = (img_no * result->step) + (r * result->image_size.width) + c;
-                                datum_no++;
+                                fragment.targets.push_back(depth_pixel[c]);
+                                fragment.pixels.push_back((r * image_size.width) + c);
                             }
                         }
                     }
                 }
             }
-            else
+        }
+    }
+
+    void DataPointCollection::AppendImageDataPoints(int img_no, const ImageFragment& fragment)
+    {
+        uint32_t image_start = img_no * step;
+        for (size_t p = 0; p < fragment.pixels.size(); p++)
+            data_.push_back(image_start + fragment.pixels[p]);
+        for (size_t p = 0; p < fragment.labels.size(); p++)
+            labels_.push_back(fragment.labels[p]);
+        for (size_t p = 0; p < fragment.targets.size(); p++)
+            targets_.push_back(fragment.targets[p]);
+    }
+
+    int DataPointCollection::LoadImageBatches(ProgramParameters& progParams, const std::vector<int>& pixel_labels,
+        std::vector<DataPointCollection*>& collections, std::ofstream* image_out)
+    {
+        int first = progParams.TrainingImagesStart;
+        int number = progParams.NumberTrainingImages;
+        int threads = std::max(1, progParams.Tpc.MaxThreads);
+        // Batches bound how many decoded images are held at once
+        int batch_size = threads * 4;
+
+        std::vector<cv::Mat> ir(batch_size), depth(batch_size), labels(batch_size);
+        std::vector<char> loaded(batch_size);
+        std::vector<std::string> errors(batch_size);
+        std::vector<std::vector<ImageFragment> > fragments(batch_size, std::vector<ImageFragment>(collections.size()));
+        int img_no = 0;
+
+        for (int b = 0; b < number; b += batch_size)
+        {
+            int count = std::min(batch_size, number - b);
+
+            // Decode, preprocess and extract each image of the batch independently
+            #pragma omp parallel for num_threads(threads) schedule(dynamic)
+            for (int j = 0; j < count; j++)
             {
-                // Regression, iterate through pixels, 
-                // If pixel's in correct depth bin, add to targets vector
-                // If not training on zero IR, then skip zero IR values
-                // If not using low memory, add index to data vector
-                for (int r = 0; r < depth_size.height; r++)
+                // Exceptions can't leave an OpenMP loop, rethrow them below
+                try
                 {
-                    uint16_t* depth_pixel = depth_image.ptr<uint16_t>(r);
-                    uchar* label_pixel = depth_labels.ptr<uchar>(r);
-                    uchar* ir_pixel = ir_preprocessed.ptr<uchar>(r);
-                    for (int c = 0; c < depth_size.width; c++)
-                    {
-                        if (class_number == label_pixel[c] || class_number == -1)
-                        {
-                            // if training on zero, always add depth target, 
-                            // Add index if not low memory implementation
-                            // If not training on zero IR input, add to targets
-                            // and also add index to data vector.
-                            if(result->train_on_zero)
-                            {
-                                result->targets_[target_no] = depth_pixel[c];
-                                target_no++;
-                                if(!(result->low_memory))
-                                {
-                                    result->data_[datum_no] = (img_no * result->step) + (r * result->image_size.width) + c;
-                                    datum_no++;
-                                }
-                            }
-                            else
-                            {
-                                if(ir_pixel[c] != 0)
-                                {
-                                    result->targets_[target_no] = depth_pixel[c];
-                                    target_no++;
-                                    result->data_[datum_no] = (img_no * result->step) + (r * result->image_size.width) + c;
-                                    datum_no++;                               
-                                }
-                            }
-                        }
-                    }
+                    loaded[j] = readTrainingImages(progParams, first + b + j, pixel_labels, ir[j], depth[j], labels[j]);
+                    if (loaded[j])
+                        for (size_t c = 0; c < collections.size(); c++)
+                            collections[c]->ExtractImageDataPoints(first + b + j, ir[j], depth[j], labels[j], fragments[j][c]);
+                }
+                catch (const std::exception& e)
+                {
+                    // Includes cv::Exception and std::bad_alloc
+                    loaded[j] = false;
+                    errors[j] = "Failed to load training image " + std::to_string(first + b + j) + ": " + e.what();
+                }
+                catch (...)
+                {
+                    loaded[j] = false;
+                    errors[j] = "Failed to load training image " + std::to_string(first + b + j);
+                }
+            }
+
+            // Then add them in file order, each image's data points following
+            // on from those of the images before it
+            for (int j = 0; j < count; j++)
+            {
+                if (!errors[j].empty())
+                    throw std::runtime_error(errors[j]);
+                if (!loaded[j])
+                    continue;
+
+                if (image_out != 0)
+                    writeImage(*image_out, ir[j], collections[0]->image_size);
+                for (size_t c = 0; c < collections.size(); c++)
+                {
+                    if (image_out == 0)
+                        collections[c]->images_[img_no] = ir[j];
+                    collections[c]->AppendImageDataPoints(img_no, fragments[j][c]);
                 }
+                img_no++;
             }
-            img_no++;
-        }
-
-        if((!result->low_memory) || (!progParams.Closeup))
-        {   
-            // Resize data and targets vector to however full they are.
-            // Shrink to fit new size to free up excess memory.
-            result->data_.resize(datum_no);
-            result->data_.shrink_to_fit();
-            result->labels_.resize(label_no);
-            result->labels_.shrink_to_fit();
-            result->targets_.resize(target_no);
-            result->targets_.shrink_to_fit();
-            result->images_.resize(img_no);
-            result->images_.shrink_to_fit();
         }
+
+        return img_no;
+    }
+
+    void DataPointCollection::FinishLoading(int img_no)
+    {
+        // Drop slots for images which were skipped, and free excess memory
+        data_.Finish();
+        labels_.Finish();
+        targets_.Finish();
+        images_.resize(img_no);
+        images_.shrink_to_fit();
+        if(low_memory)
+            data_vec_size = (uint32_t)(img_no * step);
+    }
+
+    void DataPointCollection::SetImageSize(cv::Size size)
+    {
+        image_size = size;
+        step = size.height * size.width;
+        step_divisor_ = ConstantDivisor(step);
+        width_divisor_ = ConstantDivisor(size.width);
+    }
+
+    void DataPointCollection::BuildIntegralImages()
+    {
+        integrals_.resize(images_.size());
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < (int)images_.size(); i++)
+            cv::integral(images_[i], integrals_[i], CV_32S);
+    }
+
+    void DataPointCollection::ShareIntegralImages(const ProgramParameters& progParams,
+        std::vector<std::unique_ptr<DataPointCollection> >& collections)
+    {
+        if (progParams.SplitFunctionType != SplitFunctionDescriptor::BoxDifference || collections.empty())
+            return;
+
+        collections[0]->BuildIntegralImages();
+        for (size_t s = 1; s < collections.size(); s++)
+            collections[s]->integrals_ = collections[0]->integrals_;
+    }
+
+    // Load up some images from path specified in the program parameters
+    // If it's a classifiaction forest, or a full-spread regressor, and we're 
+    // training on a zero IR input, we don't need to keep an index of all 
+    // pixel locations, they can be calculated on-the-fly. This is referred to
+    // as the "low memory" implementation in this case.
+    std::unique_ptr<DataPointCollection> DataPointCollection::LoadImages(
+        ProgramParameters& progParams, bool classification, int class_number)
+    {
+        std::vector<std::pair<bool, int> > sets(1, std::make_pair(classification, class_number));
+        return std::move(LoadImageSets(progParams, sets)[0]);
+    }
+
+    std::vector<std::unique_ptr<DataPointCollection> > DataPointCollection::LoadImageSets(
+        ProgramParameters& progParams, const std::vector<std::pair<bool, int> >& sets)
+    {
+        std::vector<std::unique_ptr<DataPointCollection> > results(sets.size());
+
+        // A dataset cache built with the same parameters saves decoding
+        // and preprocessing the images again
+        if(!progParams.DatasetCache.empty())
+        {
+            bool all_cached = true;
+            for (size_t s = 0; s < sets.size() && all_cached; s++)
+            {
+                results[s] = LoadCache(progParams, sets[s].first, sets[s].second);
+                all_cached = (bool)results[s];
+            }
+            if(all_cached)
+            {
+                ShareIntegralImages(progParams, results);
+                return results;
+            }
+        }
+
+        // for shorthand
+        std::string path = progParams.TrainingImagesPath;
+        if (!IPUtils::dirExists(path))
+            throw std::runtime_error("Failed to find directory:\t" + path);
+        
+        int number = progParams.NumberTrainingImages;
+
+        // Out-of-core: images, labels/targets and indices are written to
+        // shard files as they're loaded, then mapped back from disk.
+        bool sharded = !progParams.ShardPath.empty();
+        if(sharded && !IPUtils::dirExists(progParams.ShardPath))
+            throw std::runtime_error("Failed to find shard directory:\t" + progParams.ShardPath);
+        std::string shard_path = progParams.ShardPath;
+        if(sharded && shard_path.back() != '/')
+            shard_path += "/";
+        std::string image_shard_path;
+        std::ofstream image_shard;
+
+        std::vector<DataPointCollection*> collections;
+        for (size_t s = 0; s < sets.size(); s++)
+        {
+            bool classification = sets[s].first;
+            int class_number = sets[s].second;
+
+            // Set up DataPointCollection object
+            results[s] = Create(progParams, classification, class_number);
+            DataPointCollection* result = results[s].get();
+            collections.push_back(result);
+
+            if(sharded)
+            {
+                std::string shard_prefix = shard_path + (classification ? "class" : "reg" + std::to_string(class_number));
+                if(s == 0)
+                    image_shard_path = shard_prefix + "_images.shard";
+                result->data_.OpenShard(shard_prefix + "_indices.shard");
+                result->labels_.OpenShard(shard_prefix + "_labels.shard");
+                result->targets_.OpenShard(shard_prefix + "_targets.shard");
+            }
+
+            // If it's not a low memory implementation, we need a data vector
+            // to hold the valid pixel indices.
+            if(!(result->low_memory))
+            {
+                result->data_.reserve(result->data_vec_size);
+            }
+
+            // Save integer labels for classifier, target values for regressor
+            if(classification) 
+            {
+                result->labels_.reserve(result->data_vec_size);
+            }
+            else
+            {
+                result->targets_.reserve(result->data_vec_size);
+            }
+
+            result->images_.resize(number);
+        }
+
+        if(sharded)
+        {
+            image_shard.open(image_shard_path, std::ios::binary | std::ios::trunc);
+            if (!image_shard.is_open())
+                throw std::runtime_error("Failed to create shard file:\t" + image_shard_path);
+        }
+
+        // Each image is decoded once, every collection keeps a header onto it
+        int img_no = LoadImageBatches(progParams, results[0]->pixelLabels_, collections, sharded ? &image_shard : 0);
+
+        std::shared_ptr<MappedFile> image_mapping;
+        if(sharded)
+        {
+            image_shard.close();
+            if (image_shard.fail())
+                throw std::runtime_error("Failed to write shard file:\t" + image_shard_path);
+            image_mapping.reset(new MappedFile(image_shard_path));
+        }
+
+        for (size_t s = 0; s < results.size(); s++)
+        {
+            DataPointCollection* result = results[s].get();
+            result->FinishLoading(img_no);
+
+            if(sharded)
+            {
+                // Point the image headers into the mapped shard, no pixels are copied
+                result->imageShard_ = image_mapping;
+                uchar* pixels = (uchar*)image_mapping->Data();
+                for (int i = 0; i < img_no; i++)
+                    result->images_[i] = cv::Mat(result->image_size, CV_8UC1, pixels + (size_t)i * result->step);
+            }
+        }
+
+        ShareIntegralImages(progParams, results);
         
+        return results;
+    }
+
+    // Dataset cache file layout (native byte order):
+    //   char[8] magic, uint32 version, uint32 key length, key text,
+    //   uint32 images, width, height, sections, uint64 image offset,
+    //   CacheSection[sections]
+    // followed by the image pixels and each section's arrays, every block
+    // starting on an 8 byte boundary.
+    const char cache_magic[8] = {'F', 'T', 'T', 'D', 'S', 'E', 'T', '\0'};
+    const uint32_t cache_version = 1;
+
+    struct CacheSection
+    {
+        int32_t classification;
+        int32_t class_number;
+        uint32_t low_memory;
+        uint32_t data_vec_size;
+        uint64_t indices_offset, indices_count;
+        uint64_t labels_offset, labels_count;
+        uint64_t targets_offset, targets_count;
+    };
+
+    std::string DataPointCollection::CacheKey(const ProgramParameters& p)
+    {
+        std::ostringstream key;
+        key << "TRAINING_IMAGE_PATH " << p.TrainingImagesPath << "\n"
+            << "INPUT_PREFIX " << p.InputPrefix << "\n"
+            << "IMAGES_START " << p.TrainingImagesStart << "\n"
+            << "TRAINING_IMAGES " << p.NumberTrainingImages << "\n"
+            << "IMG_WIDTH " << p.ImgWidth << "\n"
+            << "IMG_HEIGHT " << p.ImgHeight << "\n"
+            << "WEBCAM " << p.Webcam << "\n"
+            << "DEPTH_RAW " << p.DepthRaw << "\n"
+            << "MAX_RANGE " << p.MR << "\n"
+            << "DEPTH_BINS " << p.Bins << "\n"
+            << "TH_VALUE " << p.Threshold << "\n"
+            << "TRAIN_ON_ZERO_IR " << p.TrainOnZeroIR << "\n"
+            << "IGNORE_CLOSE " << !p.Closeup << "\n"
+            << "PIXELS_PER_IMAGE " << p.PixelsPerImage << "\n";
+        if(p.PixelsPerImage > 0)
+            key << "RANDOM_SEED " << p.Tpc.RandomSeed << "\n";
+        return key.str();
+    }
+
+    std::vector<std::pair<bool, int> > DataPointCollection::TrainingSets(const ProgramParameters& p)
+    {
+        std::vector<std::pair<bool, int> > sections;
+        if(p.ForestType == ForestDescriptor::Regression)
+            sections.push_back(std::make_pair(false, -1));
+        if(p.ForestType == ForestDescriptor::ExpertRegressor)
+            sections.push_back(std::make_pair(false, p.ExpertClassNo));
+        if(p.ForestType == ForestDescriptor::All)
+            for (int i = p.TrainOnZeroIR ? 1 : 0; i < p.Bins; i++)
+                sections.push_back(std::make_pair(false, i));
+        if(p.ForestType == ForestDescriptor::Classification || p.ForestType == ForestDescriptor::All)
+            sections.push_back(std::make_pair(true, -1));
+        return sections;
+    }
+
+    uint64_t alignCacheOffset(uint64_t offset)
+    {
+        return (offset + 7) & ~(uint64_t)7;
+    }
+
+    // Writes an array at the next aligned offset, the same place
+    // BuildCache() recorded for it in the section table
+    template<class T>
+    void writeCacheArray(std::ofstream& out, const SampleArray<T>& array, uint64_t& offset)
+    {
+        static const char padding[8] = {0};
+        uint64_t aligned = alignCacheOffset(offset);
+        out.write(padding, aligned - offset);
+        out.write((const char*)array.begin(), array.size() * sizeof(T));
+        offset = aligned + array.size() * sizeof(T);
+    }
+
+    void DataPointCollection::BuildCache(ProgramParameters& progParams)
+    {
+        std::string cache_path = progParams.DatasetCache;
+        if(cache_path.empty())
+            throw std::runtime_error("DATASET_CACHE must be set to build a dataset cache");
+
+        // Clock-seeded pixel sampling keeps different pixels on every run, so
+        // there's no one result of the parameters to cache
+        if (progParams.PixelsPerImage > 0 && progParams.Tpc.RandomSeed < 0)
+            throw std::runtime_error("A dataset cache can't be built when PIXELS_PER_IMAGE samples are seeded from the clock, set RANDOM_SEED");
+
+        std::string path = progParams.TrainingImagesPath;
+        if (!IPUtils::dirExists(path))
+            throw std::runtime_error("Failed to find directory:\t" + path);
+
+        std::vector<std::pair<bool, int> > sections = TrainingSets(progParams);
+        std::vector<std::unique_ptr<DataPointCollection> > collections;
+
+        // Each collection streams its arrays to temporary files beside the
+        // cache, so only one batch of decoded images (see LoadImageBatches())
+        // is in memory at a time
+        std::vector<std::string> temp_files;
+        std::string images_temp = cache_path + ".images.tmp";
+        std::ofstream image_out(images_temp, std::ios::binary | std::ios::trunc);
+        if (!image_out.is_open())
+            throw std::runtime_error("Failed to create file:\t" + images_temp);
+        temp_files.push_back(images_temp);
+
+        for (size_t s = 0; s < sections.size(); s++)
+        {
+            collections.push_back(Create(progParams, sections[s].first, sections[s].second));
+            std::string temp_prefix = cache_path + "." + std::to_string(s);
+            collections[s]->data_.OpenShard(temp_prefix + ".indices.tmp");
+            collections[s]->labels_.OpenShard(temp_prefix + ".labels.tmp");
+            collections[s]->targets_.OpenShard(temp_prefix + ".targets.tmp");
+            temp_files.push_back(temp_prefix + ".indices.tmp");
+            temp_files.push_back(temp_prefix + ".labels.tmp");
+            temp_files.push_back(temp_prefix + ".targets.tmp");
+        }
+
+        cv::Size img_size(progParams.ImgWidth, progParams.ImgHeight);
+        std::vector<DataPointCollection*> targets;
+        for (size_t s = 0; s < collections.size(); s++)
+            targets.push_back(collections[s].get());
+        int img_no = LoadImageBatches(progParams, collections[0]->pixelLabels_, targets, &image_out);
+
+        image_out.close();
+        if (image_out.fail())
+            throw std::runtime_error("Failed to write file:\t" + images_temp);
+        for (size_t s = 0; s < collections.size(); s++)
+            collections[s]->FinishLoading(img_no);
+
+        // Write the cache beside its final name, then move it into place,
+        // so an interrupted build never leaves a truncated cache behind
+        std::string key = CacheKey(progParams);
+        std::string write_path = cache_path + ".tmp";
+        std::ofstream out(write_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            throw std::runtime_error("Failed to create file:\t" + write_path);
+
+        uint32_t key_length = key.size();
+        uint32_t header[4] = {(uint32_t)img_no, (uint32_t)img_size.width, (uint32_t)img_size.height, (uint32_t)sections.size()};
+        uint64_t offset = sizeof(cache_magic) + sizeof(cache_version) + sizeof(key_length) + key_length
+            + sizeof(header) + sizeof(uint64_t) + sections.size() * sizeof(CacheSection);
+        uint64_t image_offset = alignCacheOffset(offset);
+
+        // Work out where every block will go before writing the header
+        std::vector<CacheSection> table(sections.size());
+        offset = image_offset + (uint64_t)img_no * img_size.area();
+        for (size_t s = 0; s < sections.size(); s++)
+        {
+            DataPointCollection& c = *collections[s];
+            table[s].classification = sections[s].first;
+            table[s].class_number = sections[s].second;
+            table[s].low_memory = c.low_memory;
+            table[s].data_vec_size = c.data_vec_size;
+            table[s].indices_count = c.data_.size();
+            table[s].indices_offset = offset = alignCacheOffset(offset);
+            offset += c.data_.size() * sizeof(uint32_t);
+            table[s].labels_count = c.labels_.size();
+            table[s].labels_offset = offset = alignCacheOffset(offset);
+            offset += c.labels_.size() * sizeof(uint8_t);
+            table[s].targets_count = c.targets_.size();
+            table[s].targets_offset = offset = alignCacheOffset(offset);
+            offset += c.targets_.size() * sizeof(uint16_t);
+        }
+
+        out.write(cache_magic, sizeof(cache_magic));
+        out.write((const char*)&cache_version, sizeof(cache_version));
+        out.write((const char*)&key_length, sizeof(key_length));
+        out.write(key.data(), key_length);
+        out.write((const char*)header, sizeof(header));
+        out.write((const char*)&image_offset, sizeof(image_offset));
+        out.write((const char*)table.data(), table.size() * sizeof(CacheSection));
+
+        static const char padding[8] = {0};
+        out.write(padding, image_offset - (uint64_t)out.tellp());
+        if(img_no > 0)
+        {
+            MappedFile images(images_temp);
+            out.write((const char*)images.Data(), images.Size());
+        }
+        offset = image_offset + (uint64_t)img_no * img_size.area();
+
+        for (size_t s = 0; s < sections.size(); s++)
+        {
+            writeCacheArray(out, collections[s]->data_, offset);
+            writeCacheArray(out, collections[s]->labels_, offset);
+            writeCacheArray(out, collections[s]->targets_, offset);
+        }
+
+        out.close();
+        if (out.fail())
+            throw std::runtime_error("Failed to write file:\t" + write_path);
+
+        // Release the temporary files' mappings before removing them
+        collections.clear();
+        for (size_t f = 0; f < temp_files.size(); f++)
+            std::remove(temp_files[f].c_str());
+
+        std::remove(cache_path.c_str());
+        if (std::rename(write_path.c_str(), cache_path.c_str()) != 0)
+            throw std::runtime_error("Failed to move dataset cache into place:\t" + cache_path);
+
+        std::cout << "Dataset cache written to " << cache_path << ": " << img_no << " images, "
+            << sections.size() << " collections" << std::endl;
+    }
+
+    std::unique_ptr<DataPointCollection> DataPointCollection::LoadCache(
+        ProgramParameters& progParams, bool classification, int class_number)
+    {
+        std::string cache_path = progParams.DatasetCache;
+        if (progParams.PixelsPerImage > 0 && progParams.Tpc.RandomSeed < 0)
+        {
+            std::cout << "PIXELS_PER_IMAGE samples are seeded from the clock, not using the dataset cache" << std::endl;
+            return std::unique_ptr<DataPointCollection>();
+        }
+
+        std::shared_ptr<MappedFile> file;
+        try
+        {
+            file.reset(new MappedFile(cache_path));
+        }
+        catch (const std::runtime_error&)
+        {
+            std::cout << "No dataset cache found at " << cache_path << ", decoding images" << std::endl;
+            return std::unique_ptr<DataPointCollection>();
+        }
+
+        // Read the header, checking every read stays inside the file
+        const char* bytes = (const char*)file->Data();
+        size_t size = file->Size();
+        size_t pos = 0;
+        auto read = [&](void* to, size_t n)
+        {
+            if (pos + n > size)
+                throw std::runtime_error("Dataset cache is truncated:\t" + cache_path);
+            memcpy(to, bytes + pos, n);
+            pos += n;
+        };
+
+        char magic[sizeof(cache_magic)];
+        uint32_t version, key_length;
+        read(magic, sizeof(magic));
+        if (memcmp(magic, cache_magic, sizeof(magic)) != 0)
+            throw std::runtime_error("Not a dataset cache file:\t" + cache_path);
+        read(&version, sizeof(version));
+        if (version != cache_version)
+        {
+            std::cout << "Dataset cache " << cache_path << " is version " << version
+                << ", expected " << cache_version << ". Rebuild it with -b. Decoding images" << std::endl;
+            return std::unique_ptr<DataPointCollection>();
+        }
+        read(&key_length, sizeof(key_length));
+        if (pos + key_length > size)
+            throw std::runtime_error("Dataset cache is truncated:\t" + cache_path);
+        std::string key(bytes + pos, key_length);
+        pos += key_length;
+        if (key != CacheKey(progParams))
+        {
+            std::cout << "Dataset cache " << cache_path << " was built with different parameters, decoding images" << std::endl;
+            return std::unique_ptr<DataPointCollection>();
+        }
+
+        uint32_t header[4];
+        uint64_t image_offset;
+        read(header, sizeof(header));
+        read(&image_offset, sizeof(image_offset));
+        uint32_t images = header[0];
+        uint32_t section_count = header[3];
+
+        CacheSection section;
+        bool found = false;
+        for (uint32_t s = 0; s < section_count && !found; s++)
+        {
+            read(&section, sizeof(section));
+            found = (section.classification != 0) == classification
+                && (classification || section.class_number == class_number);
+        }
+        if (!found)
+        {
+            std::cout << "Dataset cache " << cache_path << " doesn't hold this forest's data, decoding images" << std::endl;
+            return std::unique_ptr<DataPointCollection>();
+        }
+
+        std::unique_ptr<DataPointCollection> result = Create(progParams, classification, class_number);
+        if (image_offset + (uint64_t)images * result->step > size)
+            throw std::runtime_error("Dataset cache is truncated:\t" + cache_path);
+
+        result->low_memory = section.low_memory != 0;
+        result->data_vec_size = section.data_vec_size;
+        result->data_.View(file, section.indices_offset, section.indices_count);
+        result->labels_.View(file, section.labels_offset, section.labels_count);
+        result->targets_.View(file, section.targets_offset, section.targets_count);
+
+        // Image headers point into the mapped file, no pixels are copied
+        result->imageShard_ = file;
+        result->images_.resize(images);
+        uchar* pixels = (uchar*)file->Data() + image_offset;
+        for (uint32_t i = 0; i < images; i++)
+            result->images_[i] = cv::Mat(result->image_size, CV_8UC1, pixels + (size_t)i * result->step);
+
+        std::cout << "Loaded training data from dataset cache " << cache_path << std::endl;
         return result;
     }
 
@@ -272,9 +851,8 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         // Set up DataPointCollection object
         std::unique_ptr<DataPointCollection> result = std::unique_ptr<DataPointCollection>(new DataPointCollection());
         result->dimension_ = 1;
-        result->image_size = img_size;
+        result->SetImageSize(img_size);
         result->images_.resize(1);
-        result->step = img_size.height * img_size.width;
         
         // Send the ir image for preprocessing
         if(pre_process)
@@ -296,8 +874,7 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
             result->low_memory = false;
             int rows = img_size.height;
             int cols = img_size.width;
-            int datum_no = 0;
-            result->data_.resize(rows*cols);
+            result->data_.reserve(rows*cols);
             for(int r=0;r<rows;r++)
             {
                 uchar* ir_ptr = result->images_[0].ptr<uchar>(r);
@@ -309,17 +886,63 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
                     }
                     else
                     {
-                        result->data_[datum_no] = (r * cols) + c;
-                        datum_no++;
+                        result->data_.push_back((r * cols) + c);
                     }
                 }
             }
-            result->data_.resize(datum_no);
-            result->data_.shrink_to_fit();
+            result->data_.Finish();
         }
-        
 
         return result;
     }
 
+    ImageBagSampler::ImageBagSampler(const DataPointCollection& data, float fraction, bool bootstrap):
+        data_(data), fraction_(fraction), bootstrap_(bootstrap)
+    {
+        if (fraction <= 0.0f || fraction > 1.0f)
+            throw std::runtime_error("Bag fraction must be in (0, 1]");
+    }
+
+    void ImageBagSampler::Sample(Random& random, std::vector<unsigned int>& indices) const
+    {
+        int n = data_.CountImages();
+        int k = std::max(1, (int)(fraction_ * n + 0.5f));
+
+        std::vector<int> images(bootstrap_ ? k : n);
+        if (bootstrap_)
+        {
+            for (int i = 0; i < k; i++)
+                images[i] = random.Next(0, n);
+        }
+        else
+        {
+            // Partial Fisher-Yates shuffle, keeping the first k
+            for (int i = 0; i < n; i++)
+                images[i] = i;
+            for (int i = 0; i < k; i++)
+                std::swap(images[i], images[random.Next(i, n)]);
+            images.resize(k);
+        }
+
+        // Visit the chosen images in storage order so training walks memory forwards
+        std::sort(images.begin(), images.end());
+
+        uint32_t begin, end;
+        size_t total = 0;
+        for (int i = 0; i < k; i++)
+        {
+            data_.GetImageDataPoints(images[i], begin, end);
+            total += end - begin;
+        }
+
+        indices.clear();
+        indices.reserve(total);
+        for (int i = 0; i < k; i++)
+        {
+            data_.GetImageDataPoints(images[i], begin, end);
+            for (uint32_t j = begin; j < end; j++)
+                indices.push_back(j);
+        }
+    }
+
 }   }   }
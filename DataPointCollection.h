@@ -11,12 +11,145 @@
 #include <sstream>
 
 #include "IPUtils.h"
+#include "MappedFile.h"
 #include "TrainingParameters.h"
 #include "Interfaces.h"
 
 
 namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 {
+    /// <summary>
+    /// A per-data-point array filled once, in order, while loading. It's
+    /// either held in memory or, for out-of-core training, written to a
+    /// shard file as it's filled and then mapped back from disk.
+    /// </summary>
+    template<class T>
+    class SampleArray
+    {
+        std::vector<T> memory_;
+        std::ofstream shard_;
+        std::string shardPath_;
+        std::shared_ptr<MappedFile> mapped_;
+        const T* data_;
+        size_t size_;
+
+    public:
+        SampleArray(): data_(0), size_(0)
+        {
+        }
+
+        /// <summary>
+        /// Write values to the file at path rather than keeping them in memory.
+        /// </summary>
+        void OpenShard(const std::string& path)
+        {
+            shardPath_ = path;
+            shard_.open(path, std::ios::binary | std::ios::trunc);
+            if (!shard_.is_open())
+                throw std::runtime_error("Failed to create shard file:\t" + path);
+        }
+
+        void reserve(size_t n)
+        {
+            if (!shard_.is_open())
+                memory_.reserve(n);
+        }
+
+        void push_back(const T& value)
+        {
+            if (shard_.is_open())
+                shard_.write((const char*)&value, sizeof(T));
+            else
+                memory_.push_back(value);
+            size_++;
+        }
+
+        /// <summary>
+        /// Call once all values are added, before reading any back.
+        /// </summary>
+        void Finish()
+        {
+            if (shard_.is_open())
+            {
+                shard_.close();
+                if (shard_.fail())
+                    throw std::runtime_error("Failed to write shard file:\t" + shardPath_);
+                mapped_.reset(new MappedFile(shardPath_));
+                data_ = (const T*)mapped_->Data();
+            }
+            else
+            {
+                memory_.shrink_to_fit();
+                data_ = memory_.data();
+            }
+        }
+
+        /// <summary>
+        /// Use count values of an already written file, starting offset bytes in.
+        /// </summary>
+        void View(const std::shared_ptr<MappedFile>& file, size_t offset, size_t count)
+        {
+            if (offset + count * sizeof(T) > file->Size())
+                throw std::runtime_error("Array runs past the end of its file");
+            mapped_ = file;
+            data_ = (const T*)((const char*)file->Data() + offset);
+            size_ = count;
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+        const T& operator[](size_t i) const
+        {
+            return data_[i];
+        }
+
+        const T* begin() const
+        {
+            return data_;
+        }
+
+        const T* end() const
+        {
+            return data_ + size_;
+        }
+    };
+
+
+    /// <summary>
+    /// Divides 32 bit integers by a divisor fixed in advance using
+    /// multiplications instead of a division instruction (Lemire, Kaser and
+    /// Kurz, "Faster remainder by direct computation"). Exact for every
+    /// 32 bit numerator.
+    /// </summary>
+    class ConstantDivisor
+    {
+        uint32_t divisor_;
+        // ceil(2^64 / divisor_), 0 when divisor_ is 1
+        uint64_t multiplier_;
+
+    public:
+        ConstantDivisor(uint32_t divisor=1)
+        {
+            if (divisor == 0)
+                throw std::runtime_error("Division by zero");
+            divisor_ = divisor;
+            multiplier_ = UINT64_MAX / divisor + 1;
+        }
+
+        uint32_t Divide(uint32_t n) const
+        {
+            if (divisor_ == 1)
+                return n;
+            // High 64 bits of the 96 bit product multiplier_ * n
+            uint64_t high = (multiplier_ >> 32) * n;
+            uint64_t low = ((multiplier_ & 0xFFFFFFFF) * n) >> 32;
+            return (uint32_t)((high + low) >> 32);
+        }
+    };
+
 
     /// <summary>
     /// A collection of data points, each represented by an int and (optionally)
@@ -29,23 +162,97 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     {
         // Data vector is actually the index of the actual data point ie. the index of 
         // the central pixel.
-        std::vector< uint32_t > data_;
+        SampleArray< uint32_t > data_;
         std::vector<cv::Mat> images_;
+        // Integral images of images_ for box features, empty until
+        // BuildIntegralImages() is called
+        std::vector<cv::Mat> integrals_;
+        // When training out-of-core or from a dataset cache, images_ are
+        // headers onto this mapping
+        std::shared_ptr<MappedFile> imageShard_;
+        // What the collection holds, see LoadImages()
+        bool classification_;
+        int class_number_;
+        // Pixels kept per image when sampling, 0 keeps them all
+        int pixels_per_image_;
+        // Key of the Random stream which image pixel samples derive from
+        unsigned int sampling_key_;
+
+        /// <summary>
+        /// Set up an empty collection for LoadImages() or LoadCache()
+        /// </summary>
+        static std::unique_ptr<DataPointCollection> Create(ProgramParameters& progParams, bool classification, int class_number);
+
+        /// <summary>
+        /// One image's data points, extracted independently of any other
+        /// image so that images can be processed in parallel. Pixels are
+        /// positions within the image.
+        /// </summary>
+        struct ImageFragment
+        {
+            std::vector<uint32_t> pixels;
+            std::vector<uint8_t> labels;
+            std::vector<uint16_t> targets;
+        };
+
+        /// <summary>
+        /// Work out which of a loaded image's pixels this collection keeps.
+        /// Safe to call concurrently for different images.
+        /// </summary>
+        /// <param name="file_no">The image's file number, which keys its pixel sampling</param>
+        void ExtractImageDataPoints(int file_no, const cv::Mat& ir_preprocessed,
+            const cv::Mat& depth_image, const cv::Mat& depth_labels, ImageFragment& fragment) const;
+
+        /// <summary>
+        /// Add an extracted image's data points, the image being stored as image img_no.
+        /// </summary>
+        void AppendImageDataPoints(int img_no, const ImageFragment& fragment);
+
+        /// <summary>
+        /// Decode and preprocess the training images in parallel batches, then
+        /// add each one's data points to every collection in file order.
+        /// Images are written to image_out if given, otherwise each
+        /// collection's images_ (already sized) keeps them.
+        /// Returns the number of images loaded.
+        /// </summary>
+        static int LoadImageBatches(ProgramParameters& progParams, const std::vector<int>& pixel_labels,
+            std::vector<DataPointCollection*>& collections, std::ofstream* image_out);
+
+        /// <summary>
+        /// Complete loading once img_no images have been added.
+        /// </summary>
+        void FinishLoading(int img_no);
+
+        /// <summary>
+        /// Set the size of the collection's images, and the divisors which
+        /// decode pixel offsets into them.
+        /// </summary>
+        void SetImageSize(cv::Size size);
+
+        /// <summary>
+        /// If SPLIT_FUNCTION is BOX_DIFFERENCE, build the integral images of
+        /// collections loaded together, which hold the same images, once.
+        /// </summary>
+        static void ShareIntegralImages(const ProgramParameters& progParams,
+            std::vector<std::unique_ptr<DataPointCollection> >& collections);
+
         cv::Size image_size;
         int dimension_;
         uint32_t data_vec_size;
         bool depth_raw;
         // Basically number of pixels in an image
         int step;
+        // Divide pixel offsets by step and by the image width, see GetDataPoint()
+        ConstantDivisor step_divisor_, width_divisor_;
         // vector of pixel-to-label mapping
         std::vector<int> pixelLabels_;
         
 
     public:
         // for classified data
-        std::vector<uint8_t> labels_;
+        SampleArray<uint8_t> labels_;
         // For regression, equiv of exact depth data
-        std::vector<uint16_t> targets_;
+        SampleArray<uint16_t> targets_;
         // flag to show if the DPC is a low memory implementation.
         bool low_memory;
         // flag to show if we bother training on zero intensity pixels
@@ -53,6 +260,9 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
         static const int UnknownClassLabel = -1;
 
+        // Stream of the training seed's Random used for load-time pixel sampling
+        static const unsigned int PixelSamplingStream = 0xFFFFFFFE;
+
         /// <summary>
         /// Loads a data set from a directory of IR and depth images
         /// </summary>
@@ -67,6 +277,60 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
             bool classification=true,
             int class_number=-1);
 
+        /// <summary>
+        /// Loads the data for several forests at once. Each image is decoded
+        /// and preprocessed once, and the returned collections share it.
+        /// Each collection only adds its own labels or targets and, for
+        /// filtered collections such as experts, its data point indices.
+        /// </summary>
+        /// <param name="progParams">A program parameters object which defines 
+        ///  how the program will run, its inputs, and its outputs </param>
+        /// <param name="sets">The collections to load, as (classification,
+        ///  class_number) pairs with the meaning they have in LoadImages()</param>
+        static std::vector<std::unique_ptr<DataPointCollection> > LoadImageSets(
+            ProgramParameters& progParams,
+            const std::vector<std::pair<bool, int> >& sets);
+
+        /// <summary>
+        /// The collections, as (classification, class_number) pairs, that
+        /// growSomeForests() trains forests on for the parameters' forest type.
+        /// Experts come first, then the classifier.
+        /// </summary>
+        static std::vector<std::pair<bool, int> > TrainingSets(const ProgramParameters& progParams);
+
+        /// <summary>
+        /// Decodes and preprocesses the training images once and writes every
+        /// collection the parameters' forest type trains on to the dataset
+        /// cache file progParams.DatasetCache. Throws if pixel sampling is
+        /// seeded from the clock, as the result isn't reproducible.
+        /// </summary>
+        /// <param name="progParams">A program parameters object which defines 
+        ///  the training images and how they're processed</param>
+        static void BuildCache(ProgramParameters& progParams);
+
+        /// <summary>
+        /// The parameters which decide what LoadImages() produces, as text. A
+        /// dataset cache is only used by runs whose key matches the one it was
+        /// built with, and a checkpoint only resumes with the same key. Patch
+        /// size and split function aren't included, they don't change the
+        /// loaded data.
+        /// </summary>
+        static std::string CacheKey(const ProgramParameters& p);
+
+        /// <summary>
+        /// Maps a collection from the dataset cache file progParams.DatasetCache.
+        /// Returns an empty pointer if there's no cache file, if it was built
+        /// with different parameters or without this collection, or if pixel
+        /// sampling is seeded from the clock.
+        /// </summary>
+        /// <param name="classification"> set true if for classification, 
+        ///  false if for regression </param>
+        /// <param name="class_number">Expert class number, -1 for a full regressor</param>
+        static std::unique_ptr<DataPointCollection> LoadCache(
+            ProgramParameters& progParams,
+            bool classification=true,
+            int class_number=-1);
+
         /// <summary>
         /// Loads a single cv::Mat into a DataPointCollection object for 
         /// evaluation.
@@ -134,35 +398,65 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         }
 
         /// <summary>
-        /// Get the specified data point from a low memory DataPointCollection
+        /// Get the offset of the specified data point's pixel in the image slab,
+        /// image * step + row * width + column. This is all a data point stores:
+        /// a low memory collection's data point index is its pixel offset, and
+        /// other collections keep the offset in data_.
         /// </summary>
         /// <param name="i">Zero-based data point index.</param>
-        /// <returns>tuple containing cv::Mat pointer to image and cv::point.</returns>
-        std::tuple<const cv::Mat*,cv::Point> GetDataPointLM(uint32_t i) const
+        uint32_t GetPixelOffset(uint32_t i) const
         {
-            // assuming compiler is clever enough to get quotient and remainder 
-            // in singe operation
-            uint32_t image_index = i / step;
-            uint32_t position_rem = i % step;
-            uint32_t row = position_rem / image_size.width;
-            uint32_t column = position_rem % image_size.width;
-                      
-            return std::tuple<const cv::Mat*, cv::Point>(&images_[image_index], cv::Point(column, row));
+            return low_memory ? i : data_[i];
         }
 
         /// <summary>
-        /// Get the specified data point from a regular DataPointCollection
+        /// Get the image and pixel coordinates of the specified data point,
+        /// for features to bound check their probes. Decoded from the pixel
+        /// offset with multiplications, so no division is needed.
         /// </summary>
         /// <param name="i">Zero-based data point index.</param>
-        /// <returns>tuple containing cv::Mat pointer to image and cv::point.</returns>
-        std::tuple<const cv::Mat*, cv::Point> GetDataPointRegular(uint32_t i) const
+        /// <param name="image">Set to the index of the data point's image.</param>
+        /// <param name="point">Set to the data point's pixel coordinates.</param>
+        void GetDataPoint(uint32_t i, uint32_t& image, cv::Point& point) const
         {
-            uint32_t image_index = data_[i] / step;
-            uint32_t position_rem = data_[i] % step;
-            uint32_t row = position_rem / image_size.width;
-            uint32_t column = position_rem % image_size.width;
+            uint32_t pixel = GetPixelOffset(i);
+            image = step_divisor_.Divide(pixel);
+            uint32_t position_rem = pixel - image * step;
+            uint32_t row = width_divisor_.Divide(position_rem);
+            point = cv::Point(position_rem - row * image_size.width, row);
+        }
+
+        /// <summary>
+        /// Get one of the collection's images, e.g. that of GetDataPoint().
+        /// </summary>
+        const cv::Mat& GetImage(uint32_t image) const
+        {
+            return images_[image];
+        }
 
-            return std::tuple<const cv::Mat*, cv::Point>(&images_[image_index], cv::Point(column, row));
+        /// <summary>
+        /// Compute the integral image of each of the collection's images, for
+        /// features which sum boxes of pixels. LoadImages() does this when
+        /// SPLIT_FUNCTION is BOX_DIFFERENCE, other collections, e.g. from
+        /// LoadMat(), need it called before a box feature forest is applied.
+        /// The integral images are CV_32S, four times the size of images_,
+        /// and are held in memory even when images_ are mapped from a shard
+        /// or dataset cache.
+        /// </summary>
+        void BuildIntegralImages();
+
+        bool HasIntegralImages() const
+        {
+            return !images_.empty() && integrals_.size() == images_.size();
+        }
+
+        /// <summary>
+        /// Get the integral image of one of the collection's images, a CV_32S
+        /// image one row and column larger. Needs BuildIntegralImages().
+        /// </summary>
+        const cv::Mat& GetIntegralImage(uint32_t image) const
+        {
+            return integrals_[image];
         }
 
         /// <summary>
@@ -202,6 +496,52 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         {
             return step;
         }
+
+        /// <summary>
+        /// Get the range of data point indices taken from one image. Data
+        /// points are stored image by image, so this is contiguous.
+        /// </summary>
+        /// <param name="image">Zero-based image index.</param>
+        /// <param name="begin">First data point index of the image.</param>
+        /// <param name="end">One past the last data point index of the image.</param>
+        void GetImageDataPoints(int image, uint32_t& begin, uint32_t& end) const
+        {
+            if (low_memory)
+            {
+                begin = std::min<uint32_t>(image * step, Count());
+                end = std::min<uint32_t>(begin + step, Count());
+            }
+            else
+            {
+                // data_ holds ascending pixel ids, image i's being [i*step, (i+1)*step)
+                begin = std::lower_bound(data_.begin(), data_.end(), (uint32_t)(image * step)) - data_.begin();
+                end = std::lower_bound(data_.begin() + begin, data_.end(), (uint32_t)((image + 1) * step)) - data_.begin();
+            }
+        }
+    };
+
+    /// <summary>
+    /// Draws each tree's training data as whole images from a
+    /// DataPointCollection. The bag is a list of data point indices into the
+    /// shared collection, so no image or label is copied.
+    /// </summary>
+    class ImageBagSampler: public IDataPointSampler
+    {
+        const DataPointCollection& data_;
+        float fraction_;
+        bool bootstrap_;
+
+    public:
+        /// <summary>
+        /// Sample whole images of data, fraction of them per tree.
+        /// </summary>
+        /// <param name="data">The collection to draw images from.</param>
+        /// <param name="fraction">Fraction of the collection's images drawn per tree.</param>
+        /// <param name="bootstrap">If true images are drawn with replacement,
+        ///  otherwise each image is used at most once per tree.</param>
+        ImageBagSampler(const DataPointCollection& data, float fraction, bool bootstrap);
+
+        void Sample(Random& random, std::vector<unsigned int>& indices) const;
     };
 
 }   }   }
\ No newline at end of file
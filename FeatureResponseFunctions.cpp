@@ -13,21 +13,38 @@ namespace MicrosoftResearch {
             float RandomHyperplaneFeatureResponse::GetResponse(const IDataPointCollection& data, unsigned int index) const
             {
                 const DataPointCollection& concreteData = (const DataPointCollection&)(data);
-                // Get a tuple containing a pointer to an image and the coordinate of 
-                // the pixel of interest
-                std::tuple<const cv::Mat*, cv::Point> datum;
-                if(concreteData.low_memory)
-                    datum = concreteData.GetDataPointLM(index);
-                else
-                    datum = concreteData.GetDataPointRegular(index);
-
-                // extract from tuple
-                const cv::Mat* datum_matp = std::get<0>(datum);
-                cv::Point datum_point = std::get<1>(datum);
-                cv::Size datum_mat_size = datum_matp->size();
+                // The image and coordinate of the pixel of interest
+                uint32_t image_index;
+                cv::Point datum_point;
+                concreteData.GetDataPoint(index, image_index, datum_point);
+                const cv::Mat& image = concreteData.GetImage(image_index);
                 // define image boundaries
-                cv::Rect boundry = cv::Rect(0, 0, datum_mat_size.width, datum_mat_size.height);
+                cv::Rect boundry = cv::Rect(0, 0, image.cols, image.rows);
+
+                return GetResponse(image, datum_point, boundry);
+            }
 
+            void RandomHyperplaneFeatureResponse::GetResponses(const IDataPointCollection& data, const RandomHyperplaneFeatureResponse* features, int featureCount,
+                const unsigned int* dataIndices, unsigned int count, float* responses, size_t stride)
+            {
+                const DataPointCollection& concreteData = (const DataPointCollection&)(data);
+                for (unsigned int i = 0; i < count; i++)
+                {
+                    // Look the data point up once for the whole block of features
+                    uint32_t image_index;
+                    cv::Point datum_point;
+                    concreteData.GetDataPoint(dataIndices[i], image_index, datum_point);
+                    const cv::Mat& image = concreteData.GetImage(image_index);
+                    cv::Rect boundry = cv::Rect(0, 0, image.cols, image.rows);
+
+                    for (int k = 0; k < featureCount; k++)
+                        responses[k * stride + i] = features[k].GetResponse(image, datum_point, boundry);
+                }
+            }
+
+            float RandomHyperplaneFeatureResponse::GetResponse(const cv::Mat& image, cv::Point datum_point, const cv::Rect& boundry) const
+            {
+                const cv::Mat* datum_matp = &image;
                 std::vector<cv::Point> probe_point(dimensions);
                 std::vector<float> pixel_value(dimensions);
                 
@@ -56,24 +73,39 @@ namespace MicrosoftResearch {
             float PixelSubtractionResponse::GetResponse(const IDataPointCollection& data, unsigned int index) const
             {
                 const DataPointCollection& concreteData = (const DataPointCollection&)(data);
-                // Get a tuple containing a pointer to an image and the coordinate of 
-                // the pixel of interest
-                std::tuple<const cv::Mat*, cv::Point> datum;
-                if(concreteData.low_memory)
-                {
-                    datum = concreteData.GetDataPointLM(index);
-                }
-                else
+                // The image and coordinate of the pixel of interest
+                uint32_t image_index;
+                cv::Point datum_point;
+                concreteData.GetDataPoint(index, image_index, datum_point);
+                const cv::Mat& image = concreteData.GetImage(image_index);
+                // define image boundaries
+                cv::Rect boundry = cv::Rect(0, 0, image.cols, image.rows);
+
+                return GetResponse(image, datum_point, boundry);
+            }
+
+            void PixelSubtractionResponse::GetResponses(const IDataPointCollection& data, const PixelSubtractionResponse* features, int featureCount,
+                const unsigned int* dataIndices, unsigned int count, int16_t* responses, size_t stride)
+            {
+                const DataPointCollection& concreteData = (const DataPointCollection&)(data);
+                for (unsigned int i = 0; i < count; i++)
                 {
-                    datum = concreteData.GetDataPointRegular(index);
+                    // Look the data point up once, then read every feature's
+                    // probe pair from the same patch
+                    uint32_t image_index;
+                    cv::Point datum_point;
+                    concreteData.GetDataPoint(dataIndices[i], image_index, datum_point);
+                    const cv::Mat& image = concreteData.GetImage(image_index);
+                    cv::Rect boundry = cv::Rect(0, 0, image.cols, image.rows);
+
+                    for (int k = 0; k < featureCount; k++)
+                        responses[k * stride + i] = (int16_t)features[k].GetResponse(image, datum_point, boundry);
                 }
+            }
 
-                // extract from tuple
-                const cv::Mat* datum_matp = std::get<0>(datum);
-                cv::Point datum_point = std::get<1>(datum);
-                cv::Size datum_mat_size = datum_matp->size();
-                // define image boundaries
-                cv::Rect boundry = cv::Rect(0, 0, datum_mat_size.width, datum_mat_size.height);
+            float PixelSubtractionResponse::GetResponse(const cv::Mat& image, cv::Point datum_point, const cv::Rect& boundry) const
+            {
+                const cv::Mat* datum_matp = &image;
                 cv::Point probe_point_0;
                 cv::Point probe_point_1;
                 float pixel_value_0;
@@ -96,6 +128,75 @@ namespace MicrosoftResearch {
                 float response = pixel_value_0 - pixel_value_1;
                 return response;
             }
+
+            BoxDifferenceResponse BoxDifferenceResponse::CreateRandom(Random& random, unsigned int dimensions)
+            {
+                return BoxDifferenceResponse(random, dimensions);
+            }
+
+            // Box features read integral images, which a collection only has
+            // once BuildIntegralImages() has been called
+            static const DataPointCollection& integralData(const IDataPointCollection& data)
+            {
+                const DataPointCollection& concreteData = (const DataPointCollection&)(data);
+                if (!concreteData.HasIntegralImages())
+                    throw std::runtime_error("Box difference features need the data's integral images, see DataPointCollection::BuildIntegralImages()");
+                return concreteData;
+            }
+
+            float BoxDifferenceResponse::GetResponse(const IDataPointCollection& data, unsigned int index) const
+            {
+                const DataPointCollection& concreteData = integralData(data);
+                // The image and coordinate of the pixel of interest
+                uint32_t image_index;
+                cv::Point datum_point;
+                concreteData.GetDataPoint(index, image_index, datum_point);
+
+                return GetResponse(concreteData.GetIntegralImage(image_index), datum_point);
+            }
+
+            void BoxDifferenceResponse::GetResponses(const IDataPointCollection& data, const BoxDifferenceResponse* features, int featureCount,
+                const unsigned int* dataIndices, unsigned int count, float* responses, size_t stride)
+            {
+                const DataPointCollection& concreteData = integralData(data);
+                for (unsigned int i = 0; i < count; i++)
+                {
+                    // Look the data point up once for the whole block of features
+                    uint32_t image_index;
+                    cv::Point datum_point;
+                    concreteData.GetDataPoint(dataIndices[i], image_index, datum_point);
+                    const cv::Mat& integral = concreteData.GetIntegralImage(image_index);
+
+                    for (int k = 0; k < featureCount; k++)
+                        responses[k * stride + i] = features[k].GetResponse(integral, datum_point);
+                }
+            }
+
+            // Sum of the pixels of a box offset from datum_point, clipped to
+            // the image. Four lookups in the integral image whatever its size.
+            static int boxSum(const cv::Mat& integral, cv::Point datum_point, const cv::Rect& box)
+            {
+                int x0 = std::max(datum_point.x + box.x, 0);
+                int y0 = std::max(datum_point.y + box.y, 0);
+                int x1 = std::min(datum_point.x + box.x + box.width, integral.cols - 1);
+                int y1 = std::min(datum_point.y + box.y + box.height, integral.rows - 1);
+                if (x1 <= x0 || y1 <= y0)
+                    return 0;
+
+                const int* top = integral.ptr<int>(y0);
+                const int* bottom = integral.ptr<int>(y1);
+                return bottom[x1] - bottom[x0] - top[x1] + top[x0];
+            }
+
+            float BoxDifferenceResponse::GetResponse(const cv::Mat& integral, cv::Point datum_point) const
+            {
+                // Divide by the whole box's area, so pixels outside the image
+                // count as 0 as they do for the other features
+                float mean_0 = (float)boxSum(integral, datum_point, box_0) / box_0.area();
+                float mean_1 = (float)boxSum(integral, datum_point, box_1) / box_1.area();
+
+                return mean_0 - mean_1;
+            }
             
         }
     }
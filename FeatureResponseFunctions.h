@@ -79,6 +79,16 @@ namespace MicrosoftResearch {
                 /// </summary>
                 float GetResponse(const IDataPointCollection& data, unsigned int index) const;
 
+                /// <summary>
+                /// Calculates the responses of features[0..featureCount) for the data points
+                /// dataIndices[0..count), decoding each data point once. Feature k's responses
+                /// are written to responses[k * stride .. k * stride + count).
+                /// </summary>
+                static void GetResponses(const IDataPointCollection& data, const RandomHyperplaneFeatureResponse* features, int featureCount,
+                    const unsigned int* dataIndices, unsigned int count, float* responses, size_t stride);
+
+            private:
+                float GetResponse(const cv::Mat& image, cv::Point point, const cv::Rect& boundry) const;
             };
 
             /// <summary>   f(x,u,v) = I(x+u) - I(x+v) where x is the evaluated pixel in image I
@@ -120,6 +130,104 @@ namespace MicrosoftResearch {
                 /// </summary>
                 float GetResponse(const IDataPointCollection& data, unsigned int index) const;
 
+                /// <summary>
+                /// Calculates the responses of features[0..featureCount) for the data points
+                /// dataIndices[0..count), decoding each data point once. Feature k's responses
+                /// are written to responses[k * stride .. k * stride + count).
+                /// </summary>
+                static void GetResponses(const IDataPointCollection& data, const PixelSubtractionResponse* features, int featureCount,
+                    const unsigned int* dataIndices, unsigned int count, int16_t* responses, size_t stride);
+
+            private:
+                float GetResponse(const cv::Mat& image, cv::Point point, const cv::Rect& boundry) const;
+            };
+
+            /// <summary>   f(x,A,B) = mean(I(x+A)) - mean(I(x+B)) where A and B are random
+            ///             rectangles within sqrt(dimension)/2 of the pixel x being evaluated.
+            ///             Pixels outside the image count as 0. Each box sum is four lookups
+            ///             in the image's integral image, see DataPointCollection::BuildIntegralImages(),
+            ///             so the cost doesn't depend on the size of the boxes. </summary>
+            class BoxDifferenceResponse
+            {
+            public:
+                // Each box is an offset from the pixel and a size
+                cv::Rect box_0;
+                cv::Rect box_1;
+                unsigned dimensions;
+
+                BoxDifferenceResponse() {
+                    dimensions = 0;
+                    box_0 = cv::Rect(0,0,1,1);
+                    box_1 = cv::Rect(0,0,1,1);
+                }
+
+                /// <summary>
+                /// Creates BoxDifferenceResponse object, each box's corner and size is randomly generated
+                /// </summary>
+                BoxDifferenceResponse(Random& random,
+                    unsigned int dimensions)
+                    : dimensions(dimensions)
+                {
+                    // calculate upper and lower bounds, as for PixelSubtractionResponse
+                    int ub = (int)ceil(sqrt(dimensions) / 2);
+                    int lb = 0 - ub;
+
+                    box_0 = RandomBox(random, lb, ub);
+                    box_1 = RandomBox(random, lb, ub);
+                }
+
+                static BoxDifferenceResponse CreateRandom(Random& random, unsigned int dimensions);
+
+                // IFeatureResponse implementation
+                /// <summary>
+                /// Calculates the difference of the mean pixel values of two boxes in a patch
+                /// surrounding a pixel in an image.
+                /// </summary>
+                float GetResponse(const IDataPointCollection& data, unsigned int index) const;
+
+                /// <summary>
+                /// Calculates the responses of features[0..featureCount) for the data points
+                /// dataIndices[0..count), decoding each data point once. Feature k's responses
+                /// are written to responses[k * stride .. k * stride + count).
+                /// </summary>
+                static void GetResponses(const IDataPointCollection& data, const BoxDifferenceResponse* features, int featureCount,
+                    const unsigned int* dataIndices, unsigned int count, float* responses, size_t stride);
+
+            private:
+                static cv::Rect RandomBox(Random& random, int lb, int ub)
+                {
+                    int x = random.Next(lb, ub);
+                    int y = random.Next(lb, ub);
+                    return cv::Rect(x, y, random.Next(1, ub - x + 1), random.Next(1, ub - y + 1));
+                }
+
+                float GetResponse(const cv::Mat& integral, cv::Point point) const;
+            };
+
+            // The difference of two 8 bit pixels always fits in 16 bits
+            template<>
+            struct FeatureResponseTraits<PixelSubtractionResponse>
+            {
+                typedef int16_t Response;
+            };
+
+            // Forests are tagged with their SPLIT_FUNCTION
+            template<>
+            struct FeatureTypeName<RandomHyperplaneFeatureResponse>
+            {
+                static const char* Get() { return "RANDOM_HYPERPLANE"; }
+            };
+
+            template<>
+            struct FeatureTypeName<PixelSubtractionResponse>
+            {
+                static const char* Get() { return "PIXEL_DIFFERENCE"; }
+            };
+
+            template<>
+            struct FeatureTypeName<BoxDifferenceResponse>
+            {
+                static const char* Get() { return "BOX_DIFFERENCE"; }
             };
         }
     }
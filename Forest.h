@@ -9,6 +9,7 @@
 #include <istream>
 #include <iostream>
 #include <vector>
+#include <string>
 
 #include "ProgressStream.h"
 
@@ -82,8 +83,25 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       i.read((char*)(&majorVersion), sizeof(majorVersion));
       i.read((char*)(&minorVersion), sizeof(minorVersion));
 
-      if(majorVersion==0 && minorVersion==0)
+      if(majorVersion==0 && (minorVersion==0 || minorVersion==1))
       {
+        // Version 0.1 names the forest's feature type, which must be F.
+        // Version 0.0 forests aren't tagged and are taken to be of type F.
+        if(minorVersion==1)
+        {
+          int nameLength = 0;
+          i.read((char*)(&nameLength), sizeof(nameLength));
+          if(nameLength < 0 || nameLength > 255)
+            throw std::runtime_error("Invalid data");
+
+          std::string featureType(nameLength, '\0');
+          if(nameLength > 0)
+            i.read(&featureType[0], nameLength);
+
+          if(featureType.compare(FeatureTypeName<F>::Get()) != 0)
+            throw std::runtime_error("Forest has " + featureType + " features, expected " + FeatureTypeName<F>::Get() + ".");
+        }
+
         int treeCount;
         i.read((char*)(&treeCount), sizeof(treeCount));
 
@@ -116,25 +134,37 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     /// <param name="stream">The stream.</param>
     void Serialize(std::ostream& stream)
     {
-      const int majorVersion = 0, minorVersion = 0;
+      SerializeHeader(stream, TreeCount());
+
+      for(int t=0; t<TreeCount(); t++)
+        GetTree((t)).Serialize(stream);
+
+      if(stream.bad())
+        throw std::runtime_error("Forest serialization failed.");
+    }
+
+    /// <summary>
+    /// Write the forest header for a forest of treeCount trees. The trees'
+    /// own serializations follow it, which lets a forest be assembled on
+    /// disk from separately serialized trees (see ForestCheckpoint).
+    /// </summary>
+    /// <param name="stream">The stream.</param>
+    /// <param name="treeCount">Number of trees that will follow.</param>
+    static void SerializeHeader(std::ostream& stream, int treeCount)
+    {
+      const int majorVersion = 0, minorVersion = 1;
 
       stream.write(binaryFileHeader_, strlen(binaryFileHeader_));
       stream.write((const char*)(&majorVersion), sizeof(majorVersion));
       stream.write((const char*)(&minorVersion), sizeof(minorVersion));
 
-      // NB. We could allow IFeatureResponse and IStatisticsAggregrator to
-      // write type information here for safer deserialization (and
-      // friendlier exception descriptions in the event that the user
-      // tries to deserialize a tree of the wrong type).
+      // The feature type, so Deserialize() can reject a forest of another
+      // type rather than misread it. The statistics type isn't written.
+      int nameLength = (int)strlen(FeatureTypeName<F>::Get());
+      stream.write((const char*)(&nameLength), sizeof(nameLength));
+      stream.write(FeatureTypeName<F>::Get(), nameLength);
 
-      int treeCount = TreeCount();
       stream.write((const char*)(&treeCount), sizeof(treeCount));
-
-      for(int t=0; t<TreeCount(); t++)
-        GetTree((t)).Serialize(stream);
-
-      if(stream.bad())
-        throw std::runtime_error("Forest serialization failed.");
     }
 
     /// <summary>
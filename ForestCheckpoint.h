@@ -0,0 +1,181 @@
+#pragma once
+
+// This file defines the ForestCheckpoint class, which writes each tree of a
+// forest to disk as soon as it's trained so that an interrupted training run
+// can be resumed, and so that finished trees needn't stay in memory.
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "Random.h"
+#include "TrainingParameters.h"
+#include "Tree.h"
+#include "Forest.h"
+
+namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
+{
+  /// <summary>
+  /// A set of files holding the trees trained so far for one forest.
+  /// Files are named from a prefix: prefix.ckpt records the forest seed, the
+  /// feature type, the training parameters and the data key, and prefix.tree<t> holds tree t,
+  /// serialized as by Tree::Serialize. Tree files are written under a
+  /// temporary name and renamed into place, so a tree file that exists is
+  /// always complete.
+  /// </summary>
+  template<class F, class S>
+  class ForestCheckpoint // where F:IFeatureResponse where S:IStatisticsAggregator<S>
+  {
+    std::string prefix_;
+    bool keepTrees_;
+    std::string dataKey_;
+
+  public:
+    /// <summary>
+    /// Create a checkpoint. Nothing is written until training starts.
+    /// </summary>
+    /// <param name="prefix">Path and file name prefix for the checkpoint files.</param>
+    /// <param name="keepTrees">If false, TrainForest doesn't keep trained
+    /// trees in the forest it returns; they're only on disk, and the forest
+    /// file is put together with WriteForest.</param>
+    /// <param name="dataKey">Describes the training data and anything else
+    /// the features depend on, e.g. DataPointCollection::CacheKey() and the
+    /// patch size. Trees are only resumed with the same key.</param>
+    ForestCheckpoint(const std::string& prefix, bool keepTrees=true, const std::string& dataKey="")
+      : prefix_(prefix), keepTrees_(keepTrees), dataKey_(dataKey)
+    {
+    }
+
+    bool KeepTrees() const
+    {
+      return keepTrees_;
+    }
+
+    /// <summary>
+    /// Start or resume training. A new checkpoint records the seed of the
+    /// given generator, the feature type, the training parameters and the
+    /// data key. An
+    /// existing one returns the seed it was started with, so resumed trees
+    /// come from the same streams as the finished ones even if the original
+    /// seed was taken from the clock. Resuming with different parameters or
+    /// data would mix incompatible trees, so that throws instead.
+    /// </summary>
+    /// <param name="random">The forest's random number generator.</param>
+    /// <param name="parameters">The forest's training parameters.</param>
+    /// <returns>The seed to train the forest with.</returns>
+    unsigned int Begin(const Random& random, const TrainingParameters& parameters) const
+    {
+      // Trees of another feature type wouldn't even deserialize as F
+      std::string settings = std::string("FEATURE_TYPE ") + FeatureTypeName<F>::Get() + "\n" + parameters.Describe() + dataKey_;
+      std::ifstream i(ManifestPath().c_str());
+      unsigned int key;
+      if(i >> key)
+      {
+        i.ignore(1);
+        std::string recorded((std::istreambuf_iterator<char>(i)), std::istreambuf_iterator<char>());
+        if(recorded != settings)
+          throw std::runtime_error("Checkpoint " + prefix_ + " was started with different features, training parameters or data."
+            " Remove its files or use another CHECKPOINT_PATH");
+        if(key != random.Key())
+          std::cout << "Resuming checkpoint " << prefix_ << " with its random seed " << key << std::endl;
+        return key;
+      }
+
+      std::ofstream o(ManifestPath().c_str());
+      o << random.Key() << "\n" << settings;
+      if(!o)
+        throw std::runtime_error("Failed to write checkpoint " + ManifestPath());
+
+      return random.Key();
+    }
+
+    /// <summary>
+    /// Is tree t already in the checkpoint?
+    /// </summary>
+    bool HasTree(int t) const
+    {
+      std::ifstream i(TreePath(t).c_str(), std::ios_base::binary);
+      return i.good();
+    }
+
+    /// <summary>
+    /// Read tree t back from the checkpoint.
+    /// </summary>
+    std::unique_ptr<Tree<F,S> > LoadTree(int t) const
+    {
+      std::ifstream i(TreePath(t).c_str(), std::ios_base::binary);
+      if(!i)
+        throw std::runtime_error("Failed to open checkpoint tree " + TreePath(t));
+
+      return Tree<F,S>::Deserialize(i);
+    }
+
+    /// <summary>
+    /// Write tree t to the checkpoint. Safe to call for different trees
+    /// from different threads.
+    /// </summary>
+    void SaveTree(int t, const Tree<F,S>& tree) const
+    {
+      std::string path = TreePath(t);
+      std::string temp = path + ".tmp";
+      {
+        std::ofstream o(temp.c_str(), std::ios_base::binary);
+        tree.Serialize(o);
+        if(!o)
+          throw std::runtime_error("Failed to write checkpoint tree " + temp);
+      }
+
+      if(std::rename(temp.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Failed to rename checkpoint tree to " + path);
+    }
+
+    /// <summary>
+    /// Write a forest file made of the first treeCount checkpointed trees.
+    /// The tree files are copied byte for byte, so no tree is deserialized
+    /// and the result is the same as Forest::Serialize would produce.
+    /// </summary>
+    /// <param name="path">The forest file path.</param>
+    /// <param name="treeCount">Number of trees in the forest.</param>
+    void WriteForest(const std::string& path, int treeCount) const
+    {
+      std::ofstream o(path.c_str(), std::ios_base::binary);
+      Forest<F,S>::SerializeHeader(o, treeCount);
+
+      for(int t=0; t<treeCount; t++)
+      {
+        std::ifstream i(TreePath(t).c_str(), std::ios_base::binary);
+        if(!i)
+          throw std::runtime_error("Checkpoint is missing tree " + TreePath(t));
+        o << i.rdbuf();
+      }
+
+      if(!o)
+        throw std::runtime_error("Forest serialization failed.");
+    }
+
+    /// <summary>
+    /// Delete the checkpoint files, e.g. once the forest has been saved.
+    /// </summary>
+    void Remove(int treeCount) const
+    {
+      for(int t=0; t<treeCount; t++)
+        std::remove(TreePath(t).c_str());
+      std::remove(ManifestPath().c_str());
+    }
+
+  private:
+    std::string ManifestPath() const
+    {
+      return prefix_ + ".ckpt";
+    }
+
+    std::string TreePath(int t) const
+    {
+      return prefix_ + ".tree" + std::to_string(t);
+    }
+  };
+} } }
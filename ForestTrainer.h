@@ -9,21 +9,25 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <limits>
+#include <cmath>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
 #include "ProgressStream.h"
 
+#include "Random.h"
 #include "TrainingParameters.h"
 
 #include "Interfaces.h"
 #include "Tree.h"
+#include "Forest.h"
+#include "ForestCheckpoint.h"
+#include "ThresholdSweep.h"
 
 namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 {
-  class Random;
-
     /// <summary>
   /// A decision tree training operation - used internally within TreeTrainer
   /// to represent the operation of training a single tree.
@@ -31,9 +35,15 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
   template<class F, class S>
   class TreeTrainingOperation // where F : IFeatureResponse where S : IStatisticsAggregator<S>
   {
+  public:
+    // The node's Random::Stream() reserved for drawing the pruning sample.
+    // Feature streams are indexed by candidate, so never reach it.
+    static const unsigned int PruneRandomStream = 0xFFFFFFFF;
+
   private:
     typedef typename std::vector<Node<F,S> >::size_type NodeIndex;
     typedef typename std::vector<unsigned int>::size_type DataPointIndex;
+    typedef typename FeatureResponseTraits<F>::Response Response;
 
     Random& random_;
 
@@ -45,10 +55,33 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
     std::vector<unsigned int> indices_;
 
-    std::vector<float> responses_;
+    std::vector<Response> responses_;
+    // Responses of the best candidate feature so far. Swapped with
+    // responses_ rather than copied, so the winner's responses are kept
+    // for the partition without evaluating the feature again.
+    std::vector<Response> bestResponses_;
+
+    // Scratch for stable partitions
+    std::vector<Response> partitionResponses_;
+    std::vector<unsigned int> partitionIndices_;
 
-    S parentStatistics_, leftChildStatistics_, rightChildStatistics_;
+    S parentStatistics_, leftChildStatistics_;
+    // Child statistics of the best split so far
+    S bestLeftStatistics_, bestRightStatistics_;
     std::vector<S> partitionStatistics_;
+    // suffixStatistics_[p] aggregates partitions p and above
+    std::vector<S> suffixStatistics_;
+
+    // Subsample of a large node's samples and their statistics, used for
+    // the split search when parameters_.MaxSamplesPerNode is set
+    std::vector<unsigned int> sampleIndices_;
+    S sampleStatistics_;
+
+    // Sample each candidate feature is scored on first when
+    // parameters_.PruneSampleSize is set, and the resulting gain estimates
+    std::vector<unsigned int> pruneIndices_;
+    S pruneStatistics_;
+    std::vector<double> gainEstimates_;
 
     ProgressStream progress_;
 
@@ -58,7 +91,8 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       ITrainingContext<F, S>& trainingContext,
       const TrainingParameters& parameters,
       const IDataPointCollection& data,
-      ProgressStream& progress):
+      ProgressStream& progress,
+      const std::vector<unsigned int>* dataIndices=0):
     random_(random),
       data_(data),
       trainingContext_(trainingContext),
@@ -66,31 +100,59 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     {
       parameters_ = parameters;
 
-      indices_ .resize(data.Count());
-      for (DataPointIndex i = 0; i < indices_.size(); i++)
-        indices_[i] = i;
+      if (dataIndices != 0)
+      {
+        indices_ = *dataIndices;
+        // A stable partition keeps whatever order the root has
+        if (parameters.StablePartition)
+          std::sort(indices_.begin(), indices_.end());
+      }
+      else
+      {
+        indices_ .resize(data.Count());
+        for (DataPointIndex i = 0; i < indices_.size(); i++)
+          indices_[i] = i;
+      }
 
-      responses_.resize(data.Count());
+      responses_.resize(indices_.size());
+      bestResponses_.resize(indices_.size());
 
       parentStatistics_ = trainingContext_.GetStatisticsAggregator();
+      sampleStatistics_ = trainingContext_.GetStatisticsAggregator();
+      pruneStatistics_ = trainingContext_.GetStatisticsAggregator();
+      gainEstimates_.resize(parameters.NumberOfCandidateFeatures);
 
       leftChildStatistics_ = trainingContext_.GetStatisticsAggregator();
-      rightChildStatistics_ = trainingContext_.GetStatisticsAggregator();
+      bestLeftStatistics_ = trainingContext_.GetStatisticsAggregator();
+      bestRightStatistics_ = trainingContext_.GetStatisticsAggregator();
 
       partitionStatistics_.resize(parameters.NumberOfCandidateThresholdsPerFeature + 1);
       for (unsigned int i = 0; i < parameters.NumberOfCandidateThresholdsPerFeature + 1; i++)
         partitionStatistics_[i] = trainingContext_.GetStatisticsAggregator();
+      suffixStatistics_ = partitionStatistics_;
     }
 
-    void TrainNodesRecurse(std::vector<Node<F, S> >& nodes, NodeIndex nodeIndex, DataPointIndex i0, DataPointIndex i1, int recurseDepth)
+    /// <summary>
+    /// Train the node nodeIndex from the samples indices_[i0..i1), and its
+    /// descendants.
+    /// </summary>
+    /// <param name="statistics">The samples' statistics, if the caller
+    /// already has them (as a parent does for its children). Null to
+    /// aggregate them here.</param>
+    void TrainNodesRecurse(std::vector<Node<F, S> >& nodes, NodeIndex nodeIndex, DataPointIndex i0, DataPointIndex i1, int recurseDepth, const S* statistics=0)
     {
       assert(nodeIndex < nodes.size());
       progress_[Verbose] << Tree<F, S>::GetPrettyPrintPrefix(nodeIndex) << i1 - i0 << ": ";
 
       // First aggregate statistics over the samples at the parent node
-      parentStatistics_.Clear();
-      for (DataPointIndex i = i0; i < i1; i++)
-        parentStatistics_.Aggregate(data_, indices_[i]);
+      if (statistics != 0)
+        parentStatistics_ = statistics->DeepClone();
+      else
+      {
+        parentStatistics_.Clear();
+        for (DataPointIndex i = i0; i < i1; i++)
+          parentStatistics_.Aggregate(data_, indices_[i]);
+      }
 
       if (nodeIndex >= nodes.size() / 2) // this is a leaf node, nothing else to do
       {
@@ -103,55 +165,87 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       F bestFeature;
       float bestThreshold = 0.0f;
 
-      // Iterate over candidate features
+      // Every node, and every candidate feature within it, has its own
+      // random stream so the tree doesn't depend on evaluation order.
+      Random nodeRandom = random_.Stream((unsigned int)nodeIndex);
+
+      // The split search runs over searchIndices[0..searchCount). Normally
+      // that's every sample at the node, but large nodes estimate split
+      // quality from a uniform subsample instead.
+      const unsigned int* searchIndices = indices_.data() + i0;
+      DataPointIndex searchCount = i1 - i0;
+      const S* searchStatistics = &parentStatistics_;
+      bool subsampled = false;
+      if (parameters_.MaxSamplesPerNode > 0 && i1 - i0 > parameters_.MaxSamplesPerNode)
+      {
+        nodeRandom.ReservoirSample(indices_.data() + i0, i1 - i0, parameters_.MaxSamplesPerNode, sampleIndices_);
+
+        sampleStatistics_.Clear();
+        for (DataPointIndex i = 0; i < sampleIndices_.size(); i++)
+          sampleStatistics_.Aggregate(data_, sampleIndices_[i]);
+
+        searchIndices = sampleIndices_.data();
+        searchCount = sampleIndices_.size();
+        searchStatistics = &sampleStatistics_;
+        subsampled = true;
+        progress_[Verbose] << "(searching " << searchCount << ") ";
+      }
+
       std::vector<float> thresholds;
+
+      // Race the candidates on a small sample first, if asked, and only
+      // evaluate in full those that might still win
+      double pruneCutoff = PruneCandidates(nodeRandom, searchIndices, searchCount, responses_.data() + i0, thresholds);
+
+      // Iterate over candidate features
       for (int f = 0; f < parameters_.NumberOfCandidateFeatures; f++)
       {
-        F feature = trainingContext_.GetRandomFeature(random_);
+        if (gainEstimates_[f] < pruneCutoff)
+          continue;
+
+        Random featureRandom = nodeRandom.Stream(f);
+        F feature = trainingContext_.GetRandomFeature(featureRandom);
 
         for (unsigned int b = 0; b < parameters_.NumberOfCandidateThresholdsPerFeature + 1; b++)
           partitionStatistics_[b].Clear(); // reset statistics
 
-        // Compute feature response per samples at this node
-        for (DataPointIndex i = i0; i < i1; i++)
-          responses_[i] = feature.GetResponse(data_, indices_[i]);
+        // Compute feature response per samples at this node, into this
+        // node's slice of responses_
+        Response* searchResponses = responses_.data() + i0;
+        for (DataPointIndex i = 0; i < searchCount; i++)
+          searchResponses[i] = (Response)feature.GetResponse(data_, searchIndices[i]);
 
         int nThresholds;
-        if ((nThresholds = ChooseCandidateThresholds(random_, &indices_[0], i0, i1, &responses_[0], thresholds)) == 0)
+        if ((nThresholds = ChooseCandidateThresholds(featureRandom, 0, searchCount, searchResponses, thresholds)) == 0)
           continue;
 
         // Aggregate statistics over sample partitions
-        for (DataPointIndex i = i0; i < i1; i++)
-        {
-          int b = 0;
-          while (b < nThresholds && responses_[i] >= thresholds[b])
-            b++;
+        for (DataPointIndex i = 0; i < searchCount; i++)
+          partitionStatistics_[FindPartition(thresholds.data(), nThresholds, searchResponses[i])].Aggregate(data_, searchIndices[i]);
 
-          partitionStatistics_[b].Aggregate(data_, indices_[i]);
-        }
-
-        for (int t = 0; t < nThresholds; t++)
-        {
-          leftChildStatistics_.Clear();
-          rightChildStatistics_.Clear();
-          for (int p = 0; p < nThresholds + 1 /*i.e. nBins*/; p++)
-          {
-            if (p <= t)
-              leftChildStatistics_.Aggregate(partitionStatistics_[p]);
-            else
-              rightChildStatistics_.Aggregate(partitionStatistics_[p]);
-          }
-
-          // Compute gain over sample partitions
-          double gain = trainingContext_.ComputeInformationGain(parentStatistics_, leftChildStatistics_, rightChildStatistics_);
-
-          if (gain >= maxGain)
+        // Score every threshold in one sweep
+        bool improved = false;
+        SweepThresholds(partitionStatistics_, suffixStatistics_, leftChildStatistics_, nThresholds,
+          [&](int t, const S& left, const S& right)
           {
-            maxGain = gain;
-            bestFeature = feature;
-            bestThreshold = thresholds[t];
-          }
-        }
+            // Compute gain over sample partitions
+            double gain = trainingContext_.ComputeInformationGain(*searchStatistics, left, right);
+
+            if (gain >= maxGain)
+            {
+              maxGain = gain;
+              bestFeature = feature;
+              bestThreshold = thresholds[t];
+              improved = true;
+
+              // Over all the node's samples these are the child statistics
+              bestLeftStatistics_ = left.DeepClone();
+              bestRightStatistics_ = right.DeepClone();
+            }
+          });
+
+        if (improved)
+          responses_.swap(bestResponses_);
       }
 
       if (maxGain == 0.0)
@@ -161,22 +255,28 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         return;
       }
 
-      // Now reorder the data point indices using the winning feature and thresholds.
-      // Also recompute child node statistics so the client can decide whether
-      // to terminate training of this branch.
-      leftChildStatistics_.Clear();
-      rightChildStatistics_.Clear();
-
-      for (DataPointIndex i = i0; i < i1; i++)
+      // If the search saw every sample bestResponses_ holds the winning
+      // feature's responses, otherwise they're evaluated now
+      if (subsampled)
       {
-        responses_[i] = bestFeature.GetResponse(data_, indices_[i]);
-        if (responses_[i] < bestThreshold)
-          leftChildStatistics_.Aggregate(data_, indices_[i]);
-        else
-          rightChildStatistics_.Aggregate(data_, indices_[i]);
+        for (DataPointIndex i = i0; i < i1; i++)
+          bestResponses_[i] = (Response)bestFeature.GetResponse(data_, indices_[i]);
       }
 
-      if (trainingContext_.ShouldTerminate(parentStatistics_, leftChildStatistics_, rightChildStatistics_, maxGain))
+      // Now do partition sort - any sample with response greater goes left, otherwise right
+      DataPointIndex ii = PartitionSamples(bestResponses_, i0, i1, bestThreshold);
+
+      assert(ii >= i0 && i1 >= ii);
+
+      // Child node statistics (over all samples, even if the search was
+      // subsampled) so the client can decide whether to terminate training
+      // of this branch. A full search already has them. After a subsampled
+      // one only the smaller child is aggregated; the other is the parent
+      // minus it.
+      if (subsampled)
+        SplitStatistics(parentStatistics_, i0, ii, i1, bestLeftStatistics_, bestRightStatistics_);
+
+      if (trainingContext_.ShouldTerminate(parentStatistics_, bestLeftStatistics_, bestRightStatistics_, maxGain))
       {
         nodes[nodeIndex].InitializeLeaf(parentStatistics_);
         progress_[Verbose] << "Terminating with no split." << std::endl;
@@ -186,24 +286,155 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       // Otherwise this is a new decision node, recurse for children.
       nodes[nodeIndex].InitializeSplit(bestFeature, bestThreshold, parentStatistics_);
 
-      // Now do partition sort - any sample with response greater goes left, otherwise right
-      DataPointIndex ii = Tree<F, S>::Partition(responses_, indices_, i0, i1, bestThreshold);
-
-      assert(ii >= i0 && i1 >= ii);
-
       progress_[Verbose] << " (threshold = " << bestThreshold << ", gain = "<< maxGain << ")." << std::endl;
 
-      TrainNodesRecurse(nodes, nodeIndex * 2 + 1, i0, ii, recurseDepth + 1);
-      TrainNodesRecurse(nodes, nodeIndex * 2 + 2, ii, i1, recurseDepth + 1);
+      // The children reuse the members, so keep their statistics here
+      S leftStatistics = bestLeftStatistics_.DeepClone();
+      S rightStatistics = bestRightStatistics_.DeepClone();
+
+      TrainNodesRecurse(nodes, nodeIndex * 2 + 1, i0, ii, recurseDepth + 1, &leftStatistics);
+      TrainNodesRecurse(nodes, nodeIndex * 2 + 2, ii, i1, recurseDepth + 1, &rightStatistics);
     }
 
   private:
+    /// <summary>
+    /// The best gain a feature achieves over samples[0..count), whose
+    /// statistics are given, trying the usual number of candidate
+    /// thresholds. Used to estimate a candidate's gain from a sample.
+    /// </summary>
+    double EstimateGain(const F& feature, Random& random, const unsigned int* samples, DataPointIndex count, const S& statistics, Response* responses, std::vector<float>& thresholds)
+    {
+      for (unsigned int b = 0; b < parameters_.NumberOfCandidateThresholdsPerFeature + 1; b++)
+        partitionStatistics_[b].Clear();
+
+      for (DataPointIndex i = 0; i < count; i++)
+        responses[i] = (Response)feature.GetResponse(data_, samples[i]);
+
+      int nThresholds;
+      if ((nThresholds = ChooseCandidateThresholds(random, 0, count, responses, thresholds)) == 0)
+        return 0.0;
+
+      for (DataPointIndex i = 0; i < count; i++)
+        partitionStatistics_[FindPartition(thresholds.data(), nThresholds, responses[i])].Aggregate(data_, samples[i]);
+
+      double maxGain = 0.0;
+      SweepThresholds(partitionStatistics_, suffixStatistics_, leftChildStatistics_, nThresholds,
+        [&](int, const S& left, const S& right)
+        {
+          maxGain = std::max(maxGain, trainingContext_.ComputeInformationGain(statistics, left, right));
+        });
+
+      return maxGain;
+    }
+
+    /// <summary>
+    /// Score every candidate feature on a random sample of
+    /// parameters_.PruneSampleSize of the search samples, into
+    /// gainEstimates_. Candidates whose estimate is more than two margins
+    /// GainRange() * sqrt(ln(1/delta) / 2n) below the best are pruned.
+    /// This is a heuristic, not a bound: the margin is a Hoeffding interval
+    /// for one split, but each estimate is a maximum over thresholds and
+    /// no union bound is taken over the candidates, so pruning may discard
+    /// the true winner. Pruning depends only on the node's random streams,
+    /// never on evaluation order.
+    /// </summary>
+    /// <returns>Estimates below this needn't be evaluated in full.</returns>
+    double PruneCandidates(const Random& nodeRandom, const unsigned int* searchIndices, DataPointIndex searchCount, Response* responses, std::vector<float>& thresholds)
+    {
+      std::fill(gainEstimates_.begin(), gainEstimates_.end(), 0.0);
+
+      double range = trainingContext_.GainRange();
+      if (parameters_.PruneSampleSize == 0 || searchCount <= 2 * parameters_.PruneSampleSize || range <= 0.0)
+        return -std::numeric_limits<double>::infinity();
+
+      Random pruneRandom = nodeRandom.Stream(PruneRandomStream);
+      pruneRandom.ReservoirSample(searchIndices, searchCount, parameters_.PruneSampleSize, pruneIndices_);
+
+      pruneStatistics_.Clear();
+      for (DataPointIndex i = 0; i < pruneIndices_.size(); i++)
+        pruneStatistics_.Aggregate(data_, pruneIndices_[i]);
+
+      double bestEstimate = 0.0;
+      for (int f = 0; f < parameters_.NumberOfCandidateFeatures; f++)
+      {
+        // The feature is drawn exactly as the full evaluation draws it
+        Random featureRandom = nodeRandom.Stream(f);
+        F feature = trainingContext_.GetRandomFeature(featureRandom);
+        gainEstimates_[f] = EstimateGain(feature, featureRandom, pruneIndices_.data(), pruneIndices_.size(), pruneStatistics_, responses, thresholds);
+        bestEstimate = std::max(bestEstimate, gainEstimates_[f]);
+      }
+
+      double margin = range * sqrt(log(1.0 / parameters_.PruneFailureProbability) / (2.0 * pruneIndices_.size()));
+      double cutoff = bestEstimate - 2.0 * margin;
+
+      int pruned = 0;
+      for (int f = 0; f < parameters_.NumberOfCandidateFeatures; f++)
+        if (gainEstimates_[f] < cutoff)
+          pruned++;
+      progress_[Verbose] << "(pruned " << pruned << ") ";
+
+      return cutoff;
+    }
+
+    /// <summary>
+    /// Partition the samples indices_[i0..i1) and their responses on the
+    /// threshold, stably and without branching if parameters_.StablePartition
+    /// is set. Otherwise Tree::Partition keeps the order trees have always
+    /// been grown with, so the scratch vectors are only used in stable mode.
+    /// </summary>
+    DataPointIndex PartitionSamples(std::vector<Response>& responses, DataPointIndex i0, DataPointIndex i1, float threshold)
+    {
+      if (parameters_.StablePartition)
+        return Tree<F, S>::StablePartition(responses, indices_, i0, i1, threshold, partitionResponses_, partitionIndices_);
+      else
+        return Tree<F, S>::Partition(responses, indices_, i0, i1, threshold);
+    }
+
+    /// <summary>
+    /// Statistics of the children indices_[i0..ii) and indices_[ii..i1) of
+    /// a node with the given statistics. Aggregates the smaller child only
+    /// and derives its sibling with Subtract.
+    /// </summary>
+    void SplitStatistics(const S& parent, DataPointIndex i0, DataPointIndex ii, DataPointIndex i1, S& left, S& right)
+    {
+      bool leftSmaller = ii - i0 <= i1 - ii;
+      S& smaller = leftSmaller ? left : right;
+      S& larger = leftSmaller ? right : left;
+
+      smaller.Clear();
+      for (DataPointIndex i = (leftSmaller ? i0 : ii); i < (leftSmaller ? ii : i1); i++)
+        smaller.Aggregate(data_, indices_[i]);
+
+      larger = parent.DeepClone();
+      larger.Subtract(smaller);
+    }
+
+    /// <summary>
+    /// The partition a response falls in for the candidate thresholds
+    /// thresholds[0..nThresholds), which are ascending: the number of
+    /// thresholds the response is >= to. A branchless binary search, so the
+    /// cost is log2(nThresholds) steps without mispredictions.
+    /// </summary>
+    static int FindPartition(const float* thresholds, int nThresholds, float response)
+    {
+      const float* base = thresholds;
+      int n = nThresholds;
+      while (n > 1)
+      {
+        int half = n / 2;
+        base = (response >= base[half]) ? base + half : base;
+        n -= half;
+      }
+
+      return (int)(base - thresholds) + (response >= *base ? 1 : 0);
+    }
+
+    template<class R>
     int ChooseCandidateThresholds(
       Random& random,
-      unsigned int* dataIndices,
       DataPointIndex i0,
       DataPointIndex i1,
-      const float* responses,
+      const R* responses,
       std::vector<float>& thresholds)
     {
       thresholds.resize(parameters_.NumberOfCandidateThresholdsPerFeature + 1);
@@ -226,14 +457,14 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       }
 
       // Sort the response values to form approximate quantiles.
-      std::sort(quantiles.begin(), quantiles.end());
+      std::sort(quantiles.begin(), quantiles.begin() + nThresholds + 1); // only the values written above
 
       if (quantiles[0] == quantiles[nThresholds])
         return 0;   // all sampled response values were the same
 
       // Compute n candidate thresholds by sampling in between n+1 approximate quantiles
       for (int i = 0; i < nThresholds; i++)
-        thresholds[i] = quantiles[i] + (float)(random_.NextDouble() * (quantiles[i + 1] - quantiles[i]));
+        thresholds[i] = quantiles[i] + (float)(random.NextDouble() * (quantiles[i + 1] - quantiles[i]));
 
       return nThresholds;
     }
@@ -250,32 +481,38 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     /// Train a new decision tree given some training data and a training
     /// problem described by an ITrainingContext instance.
     /// </summary>
-    /// <param name="random">The single random number generator.</param>
+    /// <param name="random">The tree's random number generator. Node and
+    /// feature streams are derived from it with Random::Stream().</param>
     /// <param name="progress">Progress reporting target.</param>
     /// <param name="context">The ITrainingContext instance by which
     /// the training framework interacts with the training data.
     /// Implemented within client code.</param>
     /// <param name="parameters">Training parameters.</param>
     /// <param name="data">The training data.</param>
+    /// <param name="dataIndices">Optional subset of the data to train on,
+    /// e.g. a bag drawn by an IDataPointSampler. By default every data point
+    /// is used.</param>
     /// <returns>A new decision tree.</returns>
     static std::unique_ptr<Tree<F, S> > TrainTree(
       Random& random,
       ITrainingContext<F, S>& context,
       const TrainingParameters& parameters,
       const IDataPointCollection& data,
-      ProgressStream* progress=0)
+      ProgressStream* progress=0,
+      const std::vector<unsigned int>* dataIndices=0)
     {
       ProgressStream defaultProgress(std::cout, parameters.Verbose? Verbose:Interest);
       if(progress==0)
         progress=&defaultProgress;
 
-      TreeTrainingOperation<F, S> trainingOperation(random, context, parameters, data, *progress);
+      TreeTrainingOperation<F, S> trainingOperation(random, context, parameters, data, *progress, dataIndices);
 
       std::unique_ptr<Tree<F, S> > tree = std::unique_ptr<Tree<F, S> >(new Tree<F,S>(parameters.MaxDecisionLevels));
 
       (*progress)[Verbose] << std::endl;
 
-      trainingOperation.TrainNodesRecurse(tree->GetNodes(), 0, 0, data.Count(), 0);  // will recurse until termination criterion is met
+      unsigned int count = dataIndices != 0 ? (unsigned int)dataIndices->size() : data.Count();
+      trainingOperation.TrainNodesRecurse(tree->GetNodes(), 0, 0, count, 0);  // will recurse until termination criterion is met
 
       (*progress)[Verbose] << std::endl;
 
@@ -301,26 +538,56 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     /// <param name="context">An ITrainingContext instance describing
     /// the training problem, e.g. classification, density estimation, etc. </param>
     /// <param name="data">The training data.</param>
+    /// <param name="sampler">Optional IDataPointSampler which draws each
+    /// tree's training subset (bagging). By default every tree sees all the data.</param>
+    /// <param name="checkpoint">Optional ForestCheckpoint. Trees already in
+    /// it are loaded instead of trained, and each newly trained tree is
+    /// written to it as soon as it's finished.</param>
     /// <returns>A new decision forest.</returns>
     static std::unique_ptr<Forest<F,S> > TrainForest(
       Random& random,
       const TrainingParameters& parameters,
       ITrainingContext<F,S>& context,
       const IDataPointCollection& data,
-      ProgressStream* progress=0)
+      ProgressStream* progress=0,
+      const IDataPointSampler* sampler=0,
+      ForestCheckpoint<F,S>* checkpoint=0)
     {
       ProgressStream defaultProgress(std::cout, parameters.Verbose? Verbose:Interest);
       if(progress==0)
         progress=&defaultProgress;
 
       std::unique_ptr<Forest<F,S> > forest = std::unique_ptr<Forest<F,S> >(new Forest<F,S>());
+      Random forestRandom(checkpoint != 0 ? checkpoint->Begin(random, parameters) : random.Key());
 
       for (int t = 0; t < parameters.NumberOfTrees; t++)
       {
+        if (checkpoint != 0 && checkpoint->HasTree(t))
+        {
+          (*progress)[Interest] << "\rResuming tree "<< t << " from checkpoint...";
+          if (checkpoint->KeepTrees())
+            forest->AddTree(checkpoint->LoadTree(t));
+          continue;
+        }
+
         (*progress)[Interest] << "\rTraining tree "<< t << "...";
 
-        std::unique_ptr<Tree<F, S> > tree = TreeTrainer<F, S>::TrainTree(random, context, parameters, data, progress);
-        forest->AddTree(std::move(tree));
+        Random treeRandom = forestRandom.Stream(t);
+        std::unique_ptr<Tree<F, S> > tree;
+        if (sampler != 0)
+        {
+          std::vector<unsigned int> bag;
+          Random bagRandom = treeRandom.Stream(IDataPointSampler::RandomStream);
+          sampler->Sample(bagRandom, bag);
+          tree = TreeTrainer<F, S>::TrainTree(treeRandom, context, parameters, data, progress, &bag);
+        }
+        else
+          tree = TreeTrainer<F, S>::TrainTree(treeRandom, context, parameters, data, progress);
+
+        if (checkpoint != 0)
+          checkpoint->SaveTree(t, *tree);
+        if (checkpoint == 0 || checkpoint->KeepTrees())
+          forest->AddTree(std::move(tree));
       }
       (*progress)[Interest] << "\rTrained " << parameters.NumberOfTrees << " trees.         " << std::endl;
 
@@ -335,7 +602,9 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     const TrainingParameters& parameters,
     ITrainingContext<F, S>& context,
     const IDataPointCollection& data,
-    ProgressStream* progress = 0)
+    ProgressStream* progress = 0,
+    const IDataPointSampler* sampler = 0,
+    ForestCheckpoint<F, S>* checkpoint = 0)
   {
     ProgressStream defaultProgress(std::cout, parameters.Verbose ? Verbose : Interest);
     if (progress == 0)
@@ -351,28 +620,62 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
     if (maxThreads == 1)
     {
-      forest = ForestTrainer<F, S>::TrainForest(random, parameters, context, data, progress);
+      forest = ForestTrainer<F, S>::TrainForest(random, parameters, context, data, progress, sampler, checkpoint);
     }
     else
     {
-      int current_num_threads = 0;
-      
       forest = std::unique_ptr<Forest<F, S> >(new Forest<F, S>());
 
-      omp_lock_t writelock;
-      omp_init_lock(&writelock);
+      // Each tree trains from its own random stream and lands in its own
+      // slot, so the forest is the same as the single threaded one.
+      std::vector<std::unique_ptr<Tree<F, S> > > trees(parameters.NumberOfTrees);
+      Random forestRandom(checkpoint != 0 ? checkpoint->Begin(random, parameters) : random.Key());
+
+      // Exceptions can't leave an OpenMP loop, rethrow them below
+      std::vector<std::string> errors(parameters.NumberOfTrees);
 
       #pragma omp parallel for num_threads(maxThreads)
         for (int t = 0; t < parameters.NumberOfTrees; t++)
         {
-          std::unique_ptr<Tree<F, S> > tree = TreeTrainer<F, S>::TrainTree(random,
-            context, parameters, data, progress);
-
-          omp_set_lock(&writelock);
-          forest->AddTree(std::move(tree));
-          omp_unset_lock(&writelock);
+          try
+          {
+            if (checkpoint != 0 && checkpoint->HasTree(t))
+            {
+              if (checkpoint->KeepTrees())
+                trees[t] = checkpoint->LoadTree(t);
+              continue;
+            }
+
+            Random treeRandom = forestRandom.Stream(t);
+            std::vector<unsigned int> bag;
+            if (sampler != 0)
+            {
+              Random bagRandom = treeRandom.Stream(IDataPointSampler::RandomStream);
+              sampler->Sample(bagRandom, bag);
+            }
+            trees[t] = TreeTrainer<F, S>::TrainTree(treeRandom,
+              context, parameters, data, progress, sampler != 0 ? &bag : 0);
+
+            if (checkpoint != 0)
+            {
+              checkpoint->SaveTree(t, *trees[t]);
+              if (!checkpoint->KeepTrees())
+                trees[t].reset();
+            }
+          }
+          catch (const std::exception& e)
+          {
+            errors[t] = e.what();
+          }
         }
-        omp_destroy_lock(&writelock);
+
+        for (int t = 0; t < parameters.NumberOfTrees; t++)
+          if (!errors[t].empty())
+            throw std::runtime_error(errors[t]);
+
+        if (checkpoint == 0 || checkpoint->KeepTrees())
+          for (int t = 0; t < parameters.NumberOfTrees; t++)
+            forest->AddTree(std::move(trees[t]));
     }
 
     return forest;
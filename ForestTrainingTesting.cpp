@@ -16,6 +16,7 @@ training.
 #include <vector>
 #include <stdio.h>
 #include <algorithm>
+#include <type_traits>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/highgui.hpp>
@@ -45,13 +46,52 @@ const std::string FILE_PATH = "D:\\";
 const std::string FILE_PATH = "/media/james/data_wd/";
 #endif
 
+///<summary> Trains a forest and saves it to filename. If CHECKPOINT_PATH is
+/// set each tree is written there as soon as it's trained, so rerunning an
+/// interrupted build carries on where it stopped. Trees then aren't kept in
+/// memory and the forest file is assembled from the tree files. </summary>
+///<param name="train">The TrainPar function of a Classifier or Regressor</param>
+///<param name="filename">Forest output file, also names the checkpoint</param>
+template<class F, class S>
+void trainAndSave(
+    std::unique_ptr<Forest<F, S> > (*train)(const DataPointCollection&, const TrainingParameters&, ForestCheckpoint<F, S>*),
+    const DataPointCollection& training_data,
+    const TrainingParameters& trainingParams,
+    const ProgramParameters& progParams,
+    const std::string& filename)
+{
+    if(progParams.CheckpointPath.empty())
+    {
+        std::unique_ptr<Forest<F, S> > forest = train(training_data, trainingParams, 0);
+        forest->Serialize(filename);
+        return;
+    }
+
+    std::string name = filename.substr(filename.find_last_of('/') + 1);
+    name = name.substr(0, name.rfind(".frst"));
+    std::string path = progParams.CheckpointPath;
+    if(path.back() != '/')
+        path += "/";
+
+    // The cache key leaves out the patch size, but features are drawn from it
+    std::string key = "PATCH_SIZE " + std::to_string(progParams.PatchSize) + "\n" + DataPointCollection::CacheKey(progParams);
+    ForestCheckpoint<F, S> checkpoint(path + name, false, key);
+    train(training_data, trainingParams, &checkpoint);
+    checkpoint.WriteForest(filename, trainingParams.NumberOfTrees);
+    checkpoint.Remove(trainingParams.NumberOfTrees);
+}
+
 ///<summary> Trains a classification forest using the multi-threaded training 
 /// algorithm. Saves a classification forest to the forest output path as 
 /// specified in function input object. </summary>
 ///<param name="progParams"> A reference to a program parameters object 
 /// which contains information about the input images, forest parameters
 /// and output path and naming </param>
-int trainClassificationPar(ProgramParameters& progParams)
+///<param name="preloaded">Training data already loaded by the caller, e.g.
+/// shared between the forests of an ALL build. If null it's loaded here.</param>
+// F is the split function, PixelSubtractionResponse or BoxDifferenceResponse
+template<class F = PixelSubtractionResponse>
+int trainClassificationPar(ProgramParameters& progParams, const DataPointCollection* preloaded = 0)
 {
     // Ensure the path to the training images ends in a /
     if(progParams.TrainingImagesPath.back() != '/')
@@ -60,8 +100,14 @@ int trainClassificationPar(ProgramParameters& progParams)
     std::string filename = progParams.TrainingImagesPath + progParams.OutputFilename + "_classifier.frst";
      
     // load up the training data
-    std::cout << "Searching for some IR and depth images in " << progParams.TrainingImagesPath << std::endl;
-    std::unique_ptr<DataPointCollection> training_data = DataPointCollection::LoadImages(progParams, true);
+    std::unique_ptr<DataPointCollection> loaded;
+    const DataPointCollection* training_data = preloaded;
+    if(training_data == 0)
+    {
+        std::cout << "Searching for some IR and depth images in " << progParams.TrainingImagesPath << std::endl;
+        loaded = DataPointCollection::LoadImages(progParams, true);
+        training_data = loaded.get();
+    }
     
     // Check and display some data for reference
     int images = training_data->CountImages();
@@ -73,10 +119,7 @@ int trainClassificationPar(ProgramParameters& progParams)
     std::cout << "\nAttempting training" << std::endl;
     try
     {
-        std::unique_ptr<Forest<PixelSubtractionResponse, HistogramAggregator> > forest = 
-            Classifier<PixelSubtractionResponse>::TrainPar(*training_data, progParams.Tpc);
-
-        forest->Serialize(filename);
+        trainAndSave(Classifier<F>::TrainPar, *training_data, progParams.Tpc, progParams, filename);
         std::cout << "Training complete, forest saved in :" << filename << std::endl;
     }
     catch (const std::runtime_error& e)
@@ -97,7 +140,11 @@ int trainClassificationPar(ProgramParameters& progParams)
 ///<param name="class_expert_no">If we're training an expert regressor, this
 /// is the integer class label for the expert. If -1, it's a general regressor
 /// </param>
-int trainRegressionPar(ProgramParameters& progParams, int class_expert_no = -1)
+///<param name="preloaded">Training data already loaded by the caller, e.g.
+/// shared between the forests of an ALL build. If null it's loaded here.</param>
+// F is the split function, PixelSubtractionResponse or BoxDifferenceResponse
+template<class F = PixelSubtractionResponse>
+int trainRegressionPar(ProgramParameters& progParams, int class_expert_no = -1, const DataPointCollection* preloaded = 0)
 {
     std::string file_suffix;
     
@@ -112,10 +159,15 @@ int trainRegressionPar(ProgramParameters& progParams, int class_expert_no = -1)
         progParams.TrainingImagesPath += "/";
 
     std::string filename = progParams.TrainingImagesPath + progParams.OutputFilename + file_suffix;
-    std::cout << "Searching for some IR and depth images in " << progParams.TrainingImagesPath << std::endl;
-    
     // create a DataPointCollection in the regression format
-    std::unique_ptr<DataPointCollection> training_data = DataPointCollection::LoadImages(progParams, false, class_expert_no); 
+    std::unique_ptr<DataPointCollection> loaded;
+    const DataPointCollection* training_data = preloaded;
+    if(training_data == 0)
+    {
+        std::cout << "Searching for some IR and depth images in " << progParams.TrainingImagesPath << std::endl;
+        loaded = DataPointCollection::LoadImages(progParams, false, class_expert_no);
+        training_data = loaded.get();
+    }
 
     // some checking and simple data output
     int images = training_data->CountImages();
@@ -128,10 +180,11 @@ int trainRegressionPar(ProgramParameters& progParams, int class_expert_no = -1)
     std::cout << "\nAttempting training" << std::endl;
     try
     {
-        std::unique_ptr<Forest<PixelSubtractionResponse, DiffEntropyAggregator> > forest =
-            Regressor<PixelSubtractionResponse>::TrainPar(*training_data, progParams.Tpr);
-
-        forest->Serialize(filename);
+        // Both aggregators write the same forest format
+        if(progParams.RegressionStatistics == RegressionStatisticsDescriptor::Moments)
+            trainAndSave(Regressor<F, MomentsAggregator>::TrainPar, *training_data, progParams.Tpr, progParams, filename);
+        else
+            trainAndSave(Regressor<F>::TrainPar, *training_data, progParams.Tpr, progParams, filename);
         std::cout << "Training complete, forest saved in :" << filename << std::endl;
     }
     catch (const std::runtime_error& e)
@@ -150,17 +203,24 @@ int trainRegressionPar(ProgramParameters& progParams, int class_expert_no = -1)
 ///<param name="progParams"> A reference to a program parameters object 
 /// which contains information about the input images, forest parameters
 /// and output path and naming </param>
-int trainClassificationRH(ProgramParameters& progParams)
+///<param name="preloaded">Training data already loaded by the caller, e.g.
+/// shared between the forests of an ALL build. If null it's loaded here.</param>
+int trainClassificationRH(ProgramParameters& progParams, const DataPointCollection* preloaded = 0)
 {
     if(progParams.TrainingImagesPath.back() != '/')
         progParams.TrainingImagesPath += "/";
 
     std::string filename = progParams.TrainingImagesPath + progParams.OutputFilename + "_classifier.frst";
      
-    std::cout << "Searching for some IR and depth images in " << progParams.TrainingImagesPath << std::endl;
-    
     //std::unique_ptr<DataPointCollection> training_data = DataPointCollection::LoadImagesClass(progParams);
-    std::unique_ptr<DataPointCollection> training_data = DataPointCollection::LoadImages(progParams, true);
+    std::unique_ptr<DataPointCollection> loaded;
+    const DataPointCollection* training_data = preloaded;
+    if(training_data == 0)
+    {
+        std::cout << "Searching for some IR and depth images in " << progParams.TrainingImagesPath << std::endl;
+        loaded = DataPointCollection::LoadImages(progParams, true);
+        training_data = loaded.get();
+    }
     
     int images = training_data->CountImages();
     std::cout << "Data loaded from images: " << std::to_string(images) << std::endl;
@@ -171,10 +231,7 @@ int trainClassificationRH(ProgramParameters& progParams)
     std::cout << "\nAttempting training" << std::endl;
     try
     {
-        std::unique_ptr<Forest<RandomHyperplaneFeatureResponse, HistogramAggregator> > forest = 
-            Classifier<RandomHyperplaneFeatureResponse>::TrainPar(*training_data, progParams.Tpc);
-
-        forest->Serialize(filename);
+        trainAndSave(Classifier<RandomHyperplaneFeatureResponse>::TrainPar, *training_data, progParams.Tpc, progParams, filename);
         std::cout << "Training complete, forest saved in :" << filename << std::endl;
     }
     catch (const std::runtime_error& e)
@@ -196,7 +253,9 @@ int trainClassificationRH(ProgramParameters& progParams)
 ///<param name="class_expert_no">If we're training an expert regressor, this
 /// is the integer class label for the expert. If -1, it's a general regressor
 /// </param>
-int trainRegressionRH(ProgramParameters& progParams, int class_expert_no = -1)
+///<param name="preloaded">Training data already loaded by the caller, e.g.
+/// shared between the forests of an ALL build. If null it's loaded here.</param>
+int trainRegressionRH(ProgramParameters& progParams, int class_expert_no = -1, const DataPointCollection* preloaded = 0)
 {
     std::string file_suffix;
     
@@ -210,12 +269,16 @@ int trainRegressionRH(ProgramParameters& progParams, int class_expert_no = -1)
 
     std::string filename = progParams.TrainingImagesPath + progParams.OutputFilename + file_suffix;
 
-    std::cout << "Searching for some IR and depth images in " << progParams.TrainingImagesPath << std::endl;
-
-    
     // create a DataPointCollection in the regression format
     //std::unique_ptr<DataPointCollection> training_data = DataPointCollection::LoadImagesRegression(progParams, class_expert_no); 
-    std::unique_ptr<DataPointCollection> training_data = DataPointCollection::LoadImages(progParams, false, class_expert_no); 
+    std::unique_ptr<DataPointCollection> loaded;
+    const DataPointCollection* training_data = preloaded;
+    if(training_data == 0)
+    {
+        std::cout << "Searching for some IR and depth images in " << progParams.TrainingImagesPath << std::endl;
+        loaded = DataPointCollection::LoadImages(progParams, false, class_expert_no);
+        training_data = loaded.get();
+    }
 
     int images = training_data->CountImages();
     std::cout << "Data loaded from images: " << std::to_string(images) << std::endl;
@@ -227,10 +290,11 @@ int trainRegressionRH(ProgramParameters& progParams, int class_expert_no = -1)
     std::cout << "\nAttempting training" << std::endl;
     try
     {
-        std::unique_ptr<Forest<RandomHyperplaneFeatureResponse, DiffEntropyAggregator> > forest =
-            Regressor<RandomHyperplaneFeatureResponse>::TrainPar(*training_data, progParams.Tpr);
-
-        forest->Serialize(filename);
+        // Both aggregators write the same forest format
+        if(progParams.RegressionStatistics == RegressionStatisticsDescriptor::Moments)
+            trainAndSave(Regressor<RandomHyperplaneFeatureResponse, MomentsAggregator>::TrainPar, *training_data, progParams.Tpr, progParams, filename);
+        else
+            trainAndSave(Regressor<RandomHyperplaneFeatureResponse>::TrainPar, *training_data, progParams.Tpr, progParams, filename);
         std::cout << "Training complete, forest saved in :" << filename << std::endl;
     }
     catch (const std::runtime_error& e)
@@ -650,7 +714,9 @@ int applyMultiLevel(std::string forest_path)
 /// and processing time information to cout.
 /// Also creates a file containing average depth vs depth error
 /// NOTE, for ease at the time, the test functions pick test images differently
-/// based on the test_image_prefix parameter </summary>
+/// based on the test_image_prefix parameter
+/// F is the forests' split function, PixelSubtractionResponse or
+/// BoxDifferenceResponse </summary>
 ///<param name="forest_path">Path to directory containing forest file</param>
 ///<param name="forest_prefix">eg for test_forest_classifier.frst, 
 ///  prefix = test_forest </param>
@@ -658,6 +724,7 @@ int applyMultiLevel(std::string forest_path)
 ///<param name="test_image_prefix">eg for images names as img125ir.png and 
 /// img125depth.png, prefix=img</param>
 ///<param name="num_images">integer number of test images to ecaluate</param>
+template<class F = PixelSubtractionResponse>
 int testForestAlternate(std::string forest_path,
     std::string forest_prefix,
     std::string test_image_path,
@@ -686,9 +753,9 @@ int testForestAlternate(std::string forest_path,
     std::vector<std::string> expert_path (e_path, e_path+5);
 
      // Init a vector of pointers to forests... essentially a vector of expert regressors
-    std::vector<std::unique_ptr<ForestShared<PixelSubtractionResponse, DiffEntropyAggregator> > > experts;
+    std::vector<std::unique_ptr<ForestShared<F, DiffEntropyAggregator> > > experts;
     // Init a pointer to a classifier
-    std::unique_ptr<ForestShared<PixelSubtractionResponse, HistogramAggregator> > classifier;
+    std::unique_ptr<ForestShared<F, HistogramAggregator> > classifier;
     int bins = 5;
 
     // Load the classifier and expert regressors.
@@ -696,11 +763,11 @@ int testForestAlternate(std::string forest_path,
     {
         std::cout << "Loading classifier" << std::endl;
         // load classifier
-        std::unique_ptr<Forest<PixelSubtractionResponse, HistogramAggregator> > c_forest =
-            Forest<PixelSubtractionResponse, HistogramAggregator>::Deserialize(class_path);
+        std::unique_ptr<Forest<F, HistogramAggregator> > c_forest =
+            Forest<F, HistogramAggregator>::Deserialize(class_path);
         // Create ForestShared from loaded forest
-        std::unique_ptr<ForestShared<PixelSubtractionResponse, HistogramAggregator> > c_forest_shared =
-            ForestShared<PixelSubtractionResponse, HistogramAggregator>::ForestSharedFromForest(*c_forest);
+        std::unique_ptr<ForestShared<F, HistogramAggregator> > c_forest_shared =
+            ForestShared<F, HistogramAggregator>::ForestSharedFromForest(*c_forest);
         // Delete original forest. May roll these steps into one later if we don't need a regular forest application.
         c_forest->~Forest();
         c_forest.release();
@@ -709,11 +776,11 @@ int testForestAlternate(std::string forest_path,
         for(int i=0;i<bins;i++)
         {
             std::cout << "Loading expert " << std::to_string(i) << std::endl;
-            std::unique_ptr<Forest<PixelSubtractionResponse, DiffEntropyAggregator> > e_forest =
-                Forest<PixelSubtractionResponse, DiffEntropyAggregator>::Deserialize(expert_path[i]);
+            std::unique_ptr<Forest<F, DiffEntropyAggregator> > e_forest =
+                Forest<F, DiffEntropyAggregator>::Deserialize(expert_path[i]);
             // Create ForestShared from loaded forest
-            std::unique_ptr<ForestShared<PixelSubtractionResponse, DiffEntropyAggregator> > e_forest_shared =
-                ForestShared<PixelSubtractionResponse, DiffEntropyAggregator>::ForestSharedFromForest(*e_forest);
+            std::unique_ptr<ForestShared<F, DiffEntropyAggregator> > e_forest_shared =
+                ForestShared<F, DiffEntropyAggregator>::ForestSharedFromForest(*e_forest);
             // Delete original forest. May roll these steps into one later if we don't need a regular forest application.
             e_forest->~Forest();
             e_forest.release();
@@ -826,7 +893,10 @@ int testForestAlternate(std::string forest_path,
         test_image = IPUtils::preProcess(test_image, threshold_value);
 
         std::unique_ptr<DataPointCollection> test_data1 = DataPointCollection::LoadMat(test_image, cv::Size(640, 480), false, false);
-        bins_mat = Classifier<PixelSubtractionResponse>::ApplyMat(*classifier, *test_data1);
+        // Box features read the frame's integral image
+        if(std::is_same<F, BoxDifferenceResponse>::value)
+            test_data1->BuildIntegralImages();
+        bins_mat = Classifier<F>::ApplyMat(*classifier, *test_data1);
         // Get the weights for weighted sum from  classifiaction results. 
         // Essentially represents the probability for any pixel in the image to be in 
         // a certain bin.
@@ -835,7 +905,7 @@ int testForestAlternate(std::string forest_path,
         std::vector<uint16_t> sum_weighted_output(test_data1->Count(), 0);
         for(int j=0;j<bins;j++)
         {
-            std::vector<uint16_t> expert_output = Regressor<PixelSubtractionResponse>::ApplyMat(*experts[j], *test_data1);
+            std::vector<uint16_t> expert_output = Regressor<F>::ApplyMat(*experts[j], *test_data1);
             for(int k=0;k<expert_output.size();k++)
             {
                 sum_weighted_output[k] = sum_weighted_output[k] + uint16_t(expert_output[k] * weights_vec[j]);
@@ -1556,13 +1626,16 @@ void testFunction()
 int growSomeForests(ProgramParameters& progParams)
 {
     bool rh = (progParams.SplitFunctionType == SplitFunctionDescriptor::RandomHyperplane);
+    bool box = (progParams.SplitFunctionType == SplitFunctionDescriptor::BoxDifference);
     
     if(progParams.ForestType == ForestDescriptor::Regression)
     {
         try
         {
             std::cout << "\nAttempting to grow regressor" << std::endl;
-            if(!rh)
+            if(box)
+                trainRegressionPar<BoxDifferenceResponse>(progParams, -1);
+            else if(!rh)
                 trainRegressionPar(progParams, -1);
             else
                 trainRegressionRH(progParams, -1);
@@ -1578,7 +1651,9 @@ int growSomeForests(ProgramParameters& progParams)
         try
         {
             std::cout << "\nAttempting to grow expert regressor " << std::to_string(progParams.ExpertClassNo) << std::endl;
-            if(!rh)
+            if(box)
+                trainRegressionPar<BoxDifferenceResponse>(progParams, progParams.ExpertClassNo);
+            else if(!rh)
                 trainRegressionPar(progParams, progParams.ExpertClassNo);
             else
                 trainRegressionRH(progParams, progParams.ExpertClassNo);
@@ -1591,30 +1666,78 @@ int growSomeForests(ProgramParameters& progParams)
 
     if(progParams.ForestType == ForestDescriptor::All)
     {
-        int start = progParams.TrainOnZeroIR? 1 : 0;
-        for (int i=start;i<progParams.Bins;i++)
+        // Load the images once for the experts and the classifier, each
+        // forest gets a view of the shared images
+        if(progParams.TrainingImagesPath.back() != '/')
+            progParams.TrainingImagesPath += "/";
+        std::vector<std::pair<bool, int> > sets = DataPointCollection::TrainingSets(progParams);
+        std::vector<std::unique_ptr<DataPointCollection> > training_data;
+        try
         {
+            std::cout << "Searching for some IR and depth images in " << progParams.TrainingImagesPath << std::endl;
+            training_data = DataPointCollection::LoadImageSets(progParams, sets);
+        }
+        catch (const std::runtime_error& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+
+        // With CONCURRENT_FORESTS the forests share out the threads, one
+        // each, instead of each using all of them in turn
+        int forests = sets.size();
+        int concurrent = progParams.ConcurrentForests ? std::min(forests, std::max(1, progParams.Tpc.MaxThreads)) : 1;
+        #pragma omp parallel for num_threads(concurrent) schedule(dynamic)
+        for (int f = 0; f < forests; f++)
+        {
+            ProgramParameters forestParams = progParams;
+            if(concurrent > 1)
+            {
+                forestParams.Tpc.MaxThreads = 1;
+                forestParams.Tpr.MaxThreads = 1;
+            }
+
             try
             {
-                std::cout << "\nAttempting to grow expert regressor " << std::to_string(i) << std::endl;
-                if(!rh)
-                    trainRegressionPar(progParams, i);
+                if(sets[f].first)
+                {
+                    std::cout << "\nAttempting to grow classifier" << std::endl;
+                    if(box)
+                        trainClassificationPar<BoxDifferenceResponse>(forestParams, training_data[f].get());
+                    else if(!rh)
+                        trainClassificationPar(forestParams, training_data[f].get());
+                    else
+                        trainClassificationRH(forestParams, training_data[f].get());
+                }
                 else
-                    trainRegressionRH(progParams, i);
+                {
+                    std::cout << "\nAttempting to grow expert regressor " << std::to_string(sets[f].second) << std::endl;
+                    if(box)
+                        trainRegressionPar<BoxDifferenceResponse>(forestParams, sets[f].second, training_data[f].get());
+                    else if(!rh)
+                        trainRegressionPar(forestParams, sets[f].second, training_data[f].get());
+                    else
+                        trainRegressionRH(forestParams, sets[f].second, training_data[f].get());
+                }
             }
             catch (const std::runtime_error& e)
             {
                 std::cerr << e.what() << std::endl;
             }
+
+            // Free this forest's labels or indices as soon as it's done
+            training_data[f].reset();
         }
     }   
     
-    if(progParams.ForestType == ForestDescriptor::Classification || progParams.ForestType == ForestDescriptor::All)
+    if(progParams.ForestType == ForestDescriptor::Classification)
     {
         try
         {
             std::cout << "\nAttempting to grow classifier" << std::endl;
-            if(!rh)
+            if(box)
+                trainClassificationPar<BoxDifferenceResponse>(progParams);
+            else if(!rh)
                 trainClassificationPar(progParams);
             else
                 trainClassificationRH(progParams);
@@ -1836,10 +1959,15 @@ void printUsage(bool incorrect=false)
 
     std::cout << "Command Line Useage:\n" << std::endl;
     std::cout << "To grow [a/some] forest[s]: \n\t./FTT -g /path/to/params.params" << std::endl;
+    std::cout << "To build the DATASET_CACHE file for a params file: \n\t./FTT -b /path/to/params.params" << std::endl;
     std::cout << "To run a test on multi-level forests: \n\t ./FTT -t";
     std::cout << " /path/to/forest/ forest_prefix";
     std::cout << " /path/to/test/images test_image_prefix";
     std::cout << " num_test_images" << std::endl;
+    std::cout << "To run the alternate (no zero IR) test on forests grown with\n\tSPLIT_FUNCTION BOX_DIFFERENCE: \n\t ./FTT -tb";
+    std::cout << " /path/to/forest/ forest_prefix";
+    std::cout << " /path/to/test/images test_image_prefix";
+    std::cout << " num_test_images" << std::endl;
     std::cout << "Note, when passing prefixes, things like _classifier.frst" << std::endl;
     std::cout << "and _expert0.frst and _testir.png and _testdepth.png will" << std::endl;
     std::cout << "appended automatically" << std::endl;
@@ -1878,9 +2006,26 @@ ProgramParameters getParamsFromFile(std::string& params_path)
                                     "MAX_RANGE",
                                     "TH_VALUE",
                                     "WEBCAM",
-                                    "IGNORE_CLOSE"};
-
-    int num_categories = 25;
+                                    "IGNORE_CLOSE",
+                                    "RANDOM_SEED",
+                                    "NODE_SAMPLE_CAP",
+                                    "BAG_FRACTION",
+                                    "BAG_BOOTSTRAP",
+                                    "PIXELS_PER_IMAGE",
+                                    "SHARD_PATH",
+                                    "DATASET_CACHE",
+                                    "CONCURRENT_FORESTS",
+                                    "CHECKPOINT_PATH",
+                                    "REGRESSION_STATISTICS",
+                                    "CLASS_CRITERION",
+                                    "REG_CRITERION",
+                                    "PRUNE_SAMPLE",
+                                    "HALVING_SAMPLE",
+                                    "SHARED_FEATURE_POOL",
+                                    "FEATURE_BLOCK",
+                                    "STABLE_PARTITION"};
+
+    int num_categories = 42;
     try
     {
         // Open the .params file
@@ -1942,6 +2087,23 @@ int main(int argc, char *argv[])
             progParams.prettyPrint();
             growSomeForests(progParams);
         }
+        else if(frst_arg.compare("-b") == 0)
+        {
+            std::string params_path = argv[2];
+            progParams = getParamsFromFile(params_path);
+            // The training functions add this too, keep the cache key the same
+            if(progParams.TrainingImagesPath.back() != '/')
+                progParams.TrainingImagesPath += "/";
+            progParams.prettyPrint();
+            try
+            {
+                DataPointCollection::BuildCache(progParams);
+            }
+            catch (const std::runtime_error& e)
+            {
+                std::cerr << e.what() << std::endl;
+            }
+        }
         else
         {
             printUsage(true); 
@@ -2007,6 +2169,24 @@ int main(int argc, char *argv[])
                 test_image_prefix, 
                 num_test_images);    
         }
+        else if(frst_arg.compare("-tb")==0)
+        {
+            std::string forest_path = argv[2];
+            std::string forest_prefix = argv[3];
+            std::string test_image_path = argv[4];
+            std::string test_image_prefix = argv[5];
+            int num_test_images = std::stoi(std::string(argv[6]));
+            std::cout << "Forest path: " << forest_path << std::endl;
+            std::cout << "Forest prefix: " << forest_prefix << std::endl;
+            std::cout << "Test image path: " << test_image_path << std::endl;
+            std::cout << "Test image prefix: " << test_image_prefix << std::endl;
+            std::cout << "Images to use in testing: " << std::to_string(num_test_images) << std::endl;
+            testForestAlternate<BoxDifferenceResponse>(forest_path, 
+                forest_prefix, 
+                test_image_path, 
+                test_image_prefix, 
+                num_test_images);    
+        }
         else if(frst_arg.compare("-tr")==0)
         {
             std::string forest_path = argv[2];
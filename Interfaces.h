@@ -1,5 +1,7 @@
 #pragma once
 #include <tuple>
+#include <vector>
+#include <cstdint>
 #include <opencv2/opencv.hpp>
 #include "Random.h"
 // This file defines interfaces used during decision forest training and
@@ -31,6 +33,27 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     virtual unsigned int Count() const=0;
   };
 
+  /// <summary>
+  /// Chooses which data points of a collection a tree is trained on, e.g.
+  /// for bagging. The chosen indices may repeat (sampling with replacement).
+  /// </summary>
+  class IDataPointSampler
+  {
+  public:
+    virtual ~IDataPointSampler() {};
+
+    // The tree's Random::Stream() reserved for the sampler's draw. Node
+    // streams are indexed by node, so never reach it.
+    static const unsigned int RandomStream = 0xFFFFFFFF;
+
+    /// <summary>
+    /// Fill indices with the data points for one tree.
+    /// </summary>
+    /// <param name="random">Random number generator for this tree's draw.</param>
+    /// <param name="indices">Receives the chosen data point indices.</param>
+    virtual void Sample(Random& random, std::vector<unsigned int>& indices) const=0;
+  };
+
   /// <summary>
   /// Features compute (single precision) response values for data points. A
   /// 'weak learner' comprises a feature and an associated decision threshold.
@@ -45,6 +68,38 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     /// <param name="dataIndex">The index of the data point to be evaluated.</param>
     /// <returns>A single precision response value.</returns>
     virtual float GetResponse(const IDataPointCollection& data, unsigned int dataIndex) const=0;
+
+    // ParallelTreeTrainer also needs a static
+    //   void GetResponses(const IDataPointCollection& data, const F* features, int featureCount,
+    //     const unsigned int* dataIndices, unsigned int count, FeatureResponseTraits<F>::Response* responses, size_t stride)
+    // which writes feature k's response for data point dataIndices[i] to
+    // responses[k * stride + i], so a block of features can be evaluated in
+    // one pass over the data.
+  };
+
+  /// <summary>
+  /// How the trainers store the responses of feature type F. Features whose
+  /// responses are always integers in [-32768, 32767] specialize this with
+  /// Response = int16_t, which halves the trainers' response buffers.
+  /// </summary>
+  template<class F>
+  struct FeatureResponseTraits
+  {
+    typedef float Response;
+  };
+
+  /// <summary>
+  /// The name a forest of feature type F is tagged with when it's
+  /// serialized, so it can't be read back as a forest of some other feature
+  /// type. Feature types specialize this, the default tag is empty.
+  /// </summary>
+  template<class F>
+  struct FeatureTypeName
+  {
+    static const char* Get()
+    {
+      return "";
+    }
   };
 
   /// <summary>
@@ -78,6 +133,13 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     /// <param name="i">The statistics to be combined.</param>
     virtual void Aggregate(const S& i)=0;
 
+    /// <summary>
+    /// Remove a subset's statistics, i.e. undo Aggregate(i). Used to derive
+    /// a child's statistics as its parent's minus its sibling's.
+    /// </summary>
+    /// <param name="i">The statistics of samples already aggregated here.</param>
+    virtual void Subtract(const S& i)=0;
+
     /// <summary>
     /// Called by the training framework to make a clone of the sample statistics to be stored in the leaf of a tree
     /// </summary>
@@ -119,6 +181,14 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     /// <returns>A measure of gain, e.g. entropy gain in bits.</returns>
     virtual double ComputeInformationGain(const S& parent, const S& leftChild, const S& rightChild) = 0;
 
+    /// <summary>
+    /// The range of values ComputeInformationGain can return, used to
+    /// bound the error of gains estimated from a sample when pruning
+    /// candidate features. 0 if there's no useful bound, which disables
+    /// pruning.
+    /// </summary>
+    virtual double GainRange() { return 0.0; }
+
     /// <summary>
     /// Called by the training framework to determine whether training
     /// should terminate for this branch.  Concrete implementations must
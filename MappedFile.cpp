@@ -0,0 +1,84 @@
+#include "MappedFile.h"
+
+#include <stdexcept>
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string& path)
+    : data_(0), size_(0), file_(INVALID_HANDLE_VALUE), mapping_(0)
+{
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file_ == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Failed to open file for mapping:\t" + path);
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(file_, &size);
+    size_ = (size_t)size.QuadPart;
+    // Empty files can't be mapped, leave Data() null
+    if (size_ == 0)
+        return;
+
+    mapping_ = CreateFileMappingA(file_, 0, PAGE_READONLY, 0, 0, 0);
+    if (mapping_ != 0)
+        data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (data_ == 0)
+    {
+        if (mapping_ != 0)
+            CloseHandle(mapping_);
+        CloseHandle(file_);
+        throw std::runtime_error("Failed to map file:\t" + path);
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (data_ != 0)
+        UnmapViewOfFile(data_);
+    if (mapping_ != 0)
+        CloseHandle(mapping_);
+    CloseHandle(file_);
+}
+#endif
+#ifdef __linux__
+MappedFile::MappedFile(const std::string& path)
+    : data_(0), size_(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open file for mapping:\t" + path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Failed to read size of file:\t" + path);
+    }
+    size_ = (size_t)st.st_size;
+
+    // Empty files can't be mapped, leave Data() null
+    if (size_ > 0)
+    {
+        void* mapped = mmap(0, size_, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Failed to map file:\t" + path);
+        }
+        data_ = mapped;
+    }
+    // The mapping keeps its own reference to the file
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data_ != 0)
+        munmap(data_, size_);
+}
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+// A read-only memory mapping of a whole file. Pages are read from disk as
+// they're touched and can be dropped again by the OS under memory
+// pressure, so mapped data doesn't count against the process's RAM.
+
+class MappedFile
+{
+public:
+    /// <summary>
+    /// Maps the file at path read-only. Throws std::runtime_error if the
+    /// file can't be opened or mapped.
+    /// </summary>
+    MappedFile(const std::string& path);
+    ~MappedFile();
+
+    const void* Data() const
+    {
+        return data_;
+    }
+
+    size_t Size() const
+    {
+        return size_;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    void* data_;
+    size_t size_;
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#endif
+};
@@ -74,6 +74,9 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       // Nodes are created null by default
       bIsLeaf_ = false;
       bIsSplit_ = false;
+      // Null nodes are serialized too, so don't leave anything uninitialized
+      // (otherwise identical forests can produce different files)
+      Threshold = 0.0f;
     }
 
     void Serialize(std::ostream& o) const
@@ -13,20 +13,23 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <limits>
+#include <cmath>
 
 #include <omp.h>
 
 #include "ProgressStream.h"
 
+#include "Random.h"
 #include "TrainingParameters.h"
 #include "Interfaces.h"
 #include "Tree.h"
 #include "Forest.h"
+#include "ForestCheckpoint.h"
+#include "ThresholdSweep.h"
 
 namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 {
-  class Random;
-  
   /// <summary>
   /// A decision tree training operation in which candidate feature response
   /// function evaluation is distributed over multiple threads - used
@@ -35,9 +38,21 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
   template<class F, class S>
   class ParallelTreeTrainingOperation // where F : IFeatureResponse where S : IStatisticsAggregator<S>
   {
+  public:
+    // The node's Random::Stream() reserved for drawing the pruning sample,
+    // the same as TreeTrainingOperation's.
+    static const unsigned int PruneRandomStream = 0xFFFFFFFF;
+    // Round r of successive halving draws its sample from the node's
+    // stream HalvingRandomStream - r.
+    static const unsigned int HalvingRandomStream = 0xFFFFFFFE;
+    // The pool for tree level l is drawn from the tree's stream
+    // LevelRandomStream - l, well clear of the node streams.
+    static const unsigned int LevelRandomStream = 0xFFFFFFF0;
+
   private:
     typedef typename std::vector<Node<F,S> >::size_type NodeIndex;
     typedef typename std::vector<unsigned int>::size_type DataPointIndex;
+    typedef typename FeatureResponseTraits<F>::Response Response;
 
     Random& random_;
 
@@ -51,45 +66,111 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
     S parentStatistics_, leftChildStatistics_, rightChildStatistics_;
 
-    std::vector<float> responses_;
+    std::vector<Response> responses_;
     std::vector<unsigned int> indices_;
 
+    // Scratch for stable partitions
+    std::vector<Response> partitionResponses_;
+    std::vector<unsigned int> partitionIndices_;
+
+    // Subsample of a large node's samples and their statistics, used for
+    // the split search when parameters_.MaxSamplesPerNode is set
+    std::vector<unsigned int> sampleIndices_;
+    S sampleStatistics_;
+
+    // Sample each candidate feature is scored on first when
+    // parameters_.PruneSampleSize is set, and the resulting gain estimates
+    std::vector<unsigned int> pruneIndices_;
+    S pruneStatistics_;
+    std::vector<double> gainEstimates_;
+
+    // Candidate features still to be evaluated in full, in increasing order
+    std::vector<int> candidates_;
+
     ProgressStream progress_;
 
+    // A node of the level being trained by TrainLevels, with its samples
+    // indices_[i0..i1) and their statistics. Its split is searched on
+    // searchIndices[0..searchCount), either the same samples or, for a
+    // node larger than parameters_.MaxSamplesPerNode, the subsample held
+    // in sampleIndices.
+    struct LevelNode
+    {
+      NodeIndex nodeIndex;
+      DataPointIndex i0, i1;
+      S statistics;
+
+      std::vector<unsigned int> sampleIndices;
+      S sampleStatistics;
+      const unsigned int* searchIndices;
+      DataPointIndex searchCount;
+      const S* searchStatistics;
+    };
+
+    // The best split found for a LevelNode so far
+    struct LevelSplit
+    {
+      double maxGain;
+      int featureIndex;
+      F feature;
+      float threshold;
+    };
+
     class ThreadLocalData
     {
     public:
       double maxGain;
       F bestFeature;
       float bestThreshold;
+      // Index of bestFeature amongst the node's candidates, used to break
+      // ties between threads the same way the serial trainer does.
+      int bestFeatureIndex;
 
-      S parentStatistics_, leftChildStatistics_, rightChildStatistics_;
+      S parentStatistics_, leftChildStatistics_;
+      // Child statistics of this thread's best split
+      S bestLeftStatistics_, bestRightStatistics_;
 
       std::vector<S> partitionStatistics_;
-      std::vector<float> responses_;
+      // suffixStatistics_[p] aggregates partitions p and above
+      std::vector<S> suffixStatistics_;
+      // Scratch for responses, in rows of as many as the samples being
+      // searched. Sized by ResponseRows() to the largest search so far, not
+      // to the whole data set, and reused from node to node.
+      std::vector<Response> responses_;
+      // Responses of this thread's best feature, bestResponses_[i] for
+      // the i'th sample searched
+      std::vector<Response> bestResponses_;
+      // The block of candidate features being evaluated, and their streams
+      std::vector<F> blockFeatures_;
+      std::vector<Random> blockRandoms_;
       std::vector<float> thresholds;
-
-      Random random_;
+      // This thread's best split for each node of the level, for TrainLevels
+      std::vector<LevelSplit> levelSplits_;
 
       ThreadLocalData()
       {
 
       }
 
-      ThreadLocalData(Random& random, ITrainingContext<F,S>& trainingContext_, const TrainingParameters& parameters, IDataPointCollection const & data):random_(random.Next())
+      ThreadLocalData(ITrainingContext<F,S>& trainingContext_, const TrainingParameters& parameters, int blockSize)
       {
         maxGain = 0.0;
         bestThreshold = 0.0;
+        bestFeatureIndex = -1;
         parentStatistics_ = trainingContext_.GetStatisticsAggregator();
 
         leftChildStatistics_ = trainingContext_.GetStatisticsAggregator();
-        rightChildStatistics_ = trainingContext_.GetStatisticsAggregator();
+        bestLeftStatistics_ = trainingContext_.GetStatisticsAggregator();
+        bestRightStatistics_ = trainingContext_.GetStatisticsAggregator();
 
         partitionStatistics_.resize(parameters.NumberOfCandidateThresholdsPerFeature + 1);
         for (unsigned int i = 0; i < parameters.NumberOfCandidateThresholdsPerFeature + 1; i++)
           partitionStatistics_[i] = trainingContext_.GetStatisticsAggregator();
+        suffixStatistics_ = partitionStatistics_;
 
-        responses_.resize(data.Count());
+        // responses_ and bestResponses_ grow as they're needed
+        blockFeatures_.reserve(blockSize);
+        blockRandoms_.reserve(blockSize);
         // thresholds_ will be resized() in ChooseCandidateThresholds()
       }
 
@@ -98,6 +179,28 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         maxGain = 0.0;
         bestFeature = F();
         bestThreshold = 0.0f;
+        bestFeatureIndex = -1;
+      }
+
+      void ClearLevel(size_t nodeCount)
+      {
+        LevelSplit none;
+        none.maxGain = 0.0;
+        none.featureIndex = -1;
+        none.feature = F();
+        none.threshold = 0.0f;
+        levelSplits_.assign(nodeCount, none);
+      }
+
+      /// <summary>
+      /// Scratch for rows of count responses each, row k starting at
+      /// element k * count.
+      /// </summary>
+      Response* ResponseRows(DataPointIndex count, int rows)
+      {
+        if (responses_.size() < count * rows)
+          responses_.resize(count * rows);
+        return responses_.data();
       }
     };
 
@@ -109,7 +212,8 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       ITrainingContext<F, S>& trainingContext,
       const TrainingParameters& parameters,
       const IDataPointCollection& data,
-      ProgressStream& progress):
+      ProgressStream& progress,
+      const std::vector<unsigned int>* dataIndices=0):
     random_(random),
     data_(data),
     trainingContext_(trainingContext),
@@ -117,33 +221,56 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     {
       parameters_ = parameters;
       maxThreads_ = parameters.MaxThreads;
-      indices_ .resize(data.Count());
-      for (DataPointIndex i = 0; i < indices_.size(); i++)
-        indices_[i] = i;
+      if (dataIndices != 0)
+      {
+        indices_ = *dataIndices;
+        // A stable partition keeps whatever order the root has
+        if (parameters.StablePartition)
+          std::sort(indices_.begin(), indices_.end());
+      }
+      else
+      {
+        indices_ .resize(data.Count());
+        for (DataPointIndex i = 0; i < indices_.size(); i++)
+          indices_[i] = i;
+      }
 
       parentStatistics_ = trainingContext_.GetStatisticsAggregator();
+      sampleStatistics_ = trainingContext_.GetStatisticsAggregator();
+      pruneStatistics_ = trainingContext_.GetStatisticsAggregator();
+      gainEstimates_.resize(parameters.NumberOfCandidateFeatures);
+      candidates_.reserve(parameters.NumberOfCandidateFeatures);
       leftChildStatistics_ = trainingContext_.GetStatisticsAggregator();
       rightChildStatistics_ = trainingContext_.GetStatisticsAggregator();
-      responses_.resize(data.Count());
+      responses_.resize(indices_.size());
       threadLocalData_.resize(maxThreads_);
       for (int threadIndex = 0; threadIndex < maxThreads_; threadIndex++)
         // Note use of placement new operator to initialize already-allocated memory
-        new (&threadLocalData_[threadIndex]) ThreadLocalData(random, trainingContext_, parameters_, data_);
+        new (&threadLocalData_[threadIndex]) ThreadLocalData(trainingContext_, parameters_, FeatureBlockSize(parameters_.NumberOfCandidateFeatures));
 
     }
 
-    void TrainNodesRecurse(std::vector<Node<F, S> >& nodes, NodeIndex nodeIndex, DataPointIndex i0, DataPointIndex i1, int recurseDepth)
+    /// <summary>
+    /// Train the node nodeIndex from the samples indices_[i0..i1), and its
+    /// descendants.
+    /// </summary>
+    /// <param name="statistics">The samples' statistics, if the caller
+    /// already has them (as a parent does for its children). Null to
+    /// aggregate them here.</param>
+    void TrainNodesRecurse(std::vector<Node<F, S> >& nodes, NodeIndex nodeIndex, DataPointIndex i0, DataPointIndex i1, int recurseDepth, const S* statistics=0)
     {
       assert(nodeIndex < nodes.size());
       progress_[Verbose] << Tree<F, S>::GetPrettyPrintPrefix(nodeIndex) << i1 - i0 << ": ";
       
       // First aggregate statistics over the samples at the parent node
-      parentStatistics_.Clear();
-    for (DataPointIndex i = i0; i < i1; i++)
-      parentStatistics_.Aggregate(data_, indices_[i]);
-      // Copy parent statistics to thread local storage in case client IStatisticsAggregator implementations are not reentrant
-      for (int t = 0; t < maxThreads_; t++)
-        threadLocalData_[t].parentStatistics_ = parentStatistics_.DeepClone();
+      if (statistics != 0)
+        parentStatistics_ = statistics->DeepClone();
+      else
+      {
+        parentStatistics_.Clear();
+        for (DataPointIndex i = i0; i < i1; i++)
+          parentStatistics_.Aggregate(data_, indices_[i]);
+      }
 
       if (nodeIndex >= nodes.size() / 2) // this is a leaf node, nothing else to do
       {
@@ -151,61 +278,126 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         progress_[Verbose] << "Terminating at max depth." << std::endl;
         return;
       }
-      #pragma omp parallel for
-      for(int threadIndex=0; threadIndex < maxThreads_; threadIndex++)
+      for (int threadIndex = 0; threadIndex < maxThreads_; threadIndex++)
+        threadLocalData_[threadIndex].Clear();
+
+      // Every node, and every candidate feature within it, has its own
+      // random stream so the tree doesn't depend on which thread evaluates
+      // which feature.
+      Random nodeRandom = random_.Stream((unsigned int)nodeIndex);
+
+      // The split search runs over searchIndices[0..searchCount). Normally
+      // that's every sample at the node, but large nodes estimate split
+      // quality from a uniform subsample instead.
+      const unsigned int* searchIndices = indices_.data() + i0;
+      DataPointIndex searchCount = i1 - i0;
+      const S* searchStatistics = &parentStatistics_;
+      bool subsampled = false;
+      if (parameters_.MaxSamplesPerNode > 0 && i1 - i0 > parameters_.MaxSamplesPerNode)
+      {
+        nodeRandom.ReservoirSample(indices_.data() + i0, i1 - i0, parameters_.MaxSamplesPerNode, sampleIndices_);
+
+        sampleStatistics_.Clear();
+        for (DataPointIndex i = 0; i < sampleIndices_.size(); i++)
+          sampleStatistics_.Aggregate(data_, sampleIndices_[i]);
+
+        searchIndices = sampleIndices_.data();
+        searchCount = sampleIndices_.size();
+        searchStatistics = &sampleStatistics_;
+        subsampled = true;
+        progress_[Verbose] << "(searching " << searchCount << ") ";
+      }
+
+      // Race the candidates on small samples first, if asked, and only
+      // evaluate in full those that might still win
+      if (parameters_.HalvingSampleSize > 0)
+        HalveCandidates(nodeRandom, searchIndices, searchCount);
+      else
+      {
+        double pruneCutoff = PruneCandidates(nodeRandom, searchIndices, searchCount);
+
+        candidates_.clear();
+        for (int f = 0; f < parameters_.NumberOfCandidateFeatures; f++)
+          if (gainEstimates_[f] >= pruneCutoff)
+            candidates_.push_back(f);
+      }
+
+      // Copy parent statistics to thread local storage in case client IStatisticsAggregator implementations are not reentrant
+      for (int t = 0; t < maxThreads_; t++)
+        threadLocalData_[t].parentStatistics_ = searchStatistics->DeepClone();
+
+      // Iterate over blocks of candidate features, sharing them out between
+      // threads. Each block's responses are computed in one pass over the
+      // samples, so a sample is decoded once per block rather than once per
+      // feature.
+      int blockSize = FeatureBlockSize((int)candidates_.size());
+      int blockCount = ((int)candidates_.size() + blockSize - 1) / blockSize;
+      #pragma omp parallel for num_threads(maxThreads_) schedule(dynamic)
+      for (int block = 0; block < blockCount; block++)
       {
-        ThreadLocalData& tl = threadLocalData_[threadIndex]; // shorthand
+        ThreadLocalData& tl = threadLocalData_[omp_get_thread_num()]; // shorthand
+        int c0 = block * blockSize;
+        int c1 = std::min(c0 + blockSize, (int)candidates_.size());
 
-        tl.Clear();
+        tl.blockFeatures_.clear();
+        tl.blockRandoms_.clear();
+        for (int c = c0; c < c1; c++)
+        {
+          tl.blockRandoms_.push_back(nodeRandom.Stream(candidates_[c]));
+          tl.blockFeatures_.push_back(trainingContext_.GetRandomFeature(tl.blockRandoms_.back()));
+        }
+
+        // Compute the block's responses per sample at this node; feature k's
+        // go in row k of the thread's scratch
+        Response* rows = tl.ResponseRows(searchCount, c1 - c0);
+        F::GetResponses(data_, tl.blockFeatures_.data(), c1 - c0, searchIndices, (unsigned int)searchCount, rows, searchCount);
 
-        // Iterate over candidate features
-        std::vector<float> thresholds;
-        for (int f = 0; f < parameters_.NumberOfCandidateFeatures/maxThreads_; f++)
+        for (int k = 0; k < c1 - c0; k++)
         {
-          F feature = trainingContext_.GetRandomFeature(tl.random_);
+          int f = candidates_[c0 + k];
+          const F& feature = tl.blockFeatures_[k];
+          Random& featureRandom = tl.blockRandoms_[k];
+          const Response* searchResponses = rows + k * searchCount;
 
           for (unsigned int b = 0; b < parameters_.NumberOfCandidateThresholdsPerFeature + 1; b++)
             tl.partitionStatistics_[b].Clear(); // reset statistics
 
-          // Compute feature response per samples at this node
-          for (DataPointIndex i = i0; i < i1; i++)
-            tl.responses_[i] = feature.GetResponse(data_, indices_[i]);
-
           int nThresholds;
-          if ((nThresholds = ChooseCandidateThresholds(tl.random_, &indices_[0], i0, i1, &tl.responses_[0], tl.thresholds)) == 0)
+          if ((nThresholds = ChooseCandidateThresholds(featureRandom, 0, searchCount, searchResponses, tl.thresholds)) == 0)
             continue;
 
           // Aggregate statistics over sample partitions
-          for (DataPointIndex i = i0; i < i1; i++)
-          {
-            int b = 0;
-            while (b < nThresholds && tl.responses_[i] >= tl.thresholds[b])
-              b++;
-
-            tl.partitionStatistics_[b].Aggregate(data_, indices_[i]);
-          }
+          for (DataPointIndex i = 0; i < searchCount; i++)
+            tl.partitionStatistics_[FindPartition(tl.thresholds.data(), nThresholds, searchResponses[i])].Aggregate(data_, searchIndices[i]);
 
-          for (int t = 0; t < nThresholds; t++)
-          {
-            tl.leftChildStatistics_.Clear();
-            tl.rightChildStatistics_.Clear();
-            for (int p = 0; p < nThresholds + 1 /*i.e. nBins*/; p++)
+          // Score every threshold in one sweep
+          bool improved = false;
+          SweepThresholds(tl.partitionStatistics_, tl.suffixStatistics_, tl.leftChildStatistics_, nThresholds,
+            [&](int t, const S& left, const S& right)
             {
-              if (p <= t)
-                tl.leftChildStatistics_.Aggregate(tl.partitionStatistics_[p]);
-              else
-                tl.rightChildStatistics_.Aggregate(tl.partitionStatistics_[p]);
-            }
-
-            // Compute gain over sample partitions
-            double gain = trainingContext_.ComputeInformationGain(tl.parentStatistics_, tl.leftChildStatistics_,tl. rightChildStatistics_);
-
-            if (gain >= tl.maxGain)
-            {
-              tl.maxGain = gain;
-              tl.bestFeature = feature;
-              tl.bestThreshold = tl.thresholds[t];
-            }
+              // Compute gain over sample partitions
+              double gain = trainingContext_.ComputeInformationGain(tl.parentStatistics_, left, right);
+
+              // Ties go to the later candidate, as in TreeTrainingOperation
+              if (gain > tl.maxGain || (gain == tl.maxGain && f >= tl.bestFeatureIndex))
+              {
+                tl.maxGain = gain;
+                tl.bestFeature = feature;
+                tl.bestThreshold = tl.thresholds[t];
+                tl.bestFeatureIndex = f;
+                improved = true;
+
+                tl.bestLeftStatistics_ = left.DeepClone();
+                tl.bestRightStatistics_ = right.DeepClone();
+              }
+            });
+
+          // Keep the responses of the thread's best feature for the partition
+          if (improved)
+          {
+            if (tl.bestResponses_.size() < searchCount)
+              tl.bestResponses_.resize(searchCount);
+            std::copy(searchResponses, searchResponses + searchCount, tl.bestResponses_.begin());
           }
         }
       }
@@ -214,15 +406,19 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       double maxGain = 0.0;
       F bestFeature;
       float bestThreshold=0.0;
+      int bestFeatureIndex = -1;
+      int bestThread = 0;
 
       for (int threadIndex = 0; threadIndex < maxThreads_; threadIndex++)
       {
         ThreadLocalData& tl = threadLocalData_[threadIndex];
-        if (tl.maxGain > maxGain)
+        if (tl.maxGain > maxGain || (tl.maxGain == maxGain && tl.bestFeatureIndex > bestFeatureIndex))
         {
           maxGain = tl.maxGain;
           bestFeature = tl.bestFeature;
           bestThreshold = tl.bestThreshold;
+          bestFeatureIndex = tl.bestFeatureIndex;
+          bestThread = threadIndex;
         }
       }
 
@@ -233,19 +429,35 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         return;
       }
 
-      // Now reorder the data point indices using the winning feature and thresholds.
-      // Also recompute child node statistics so the client can decide whether
-      // to terminate training of this branch.
-      leftChildStatistics_.Clear();
-      rightChildStatistics_.Clear();
+      // If the search saw every sample, the winning thread kept the
+      // winning feature's responses, otherwise they're evaluated now
+      if (subsampled)
+      {
+        for (DataPointIndex i = i0; i < i1; i++)
+          responses_[i] = (Response)bestFeature.GetResponse(data_, indices_[i]);
+      }
+      else
+      {
+        const std::vector<Response>& bestResponses = threadLocalData_[bestThread].bestResponses_;
+        std::copy(bestResponses.begin(), bestResponses.begin() + (i1 - i0), responses_.begin() + i0);
+      }
+
+      // Now do partition sort - any sample with response greater goes left, otherwise right
+      DataPointIndex ii = PartitionSamples(responses_, i0, i1, bestThreshold);
 
-      for (DataPointIndex i = i0; i < i1; i++)
+      assert(ii >= i0 && i1 >= ii);
+
+      // Child node statistics (over all samples, even if the search was
+      // subsampled) so the client can decide whether to terminate training
+      // of this branch. A full search already has them. After a subsampled
+      // one only the smaller child is aggregated; the other is the parent
+      // minus it.
+      if (subsampled)
+        SplitStatistics(parentStatistics_, i0, ii, i1, leftChildStatistics_, rightChildStatistics_);
+      else
       {
-        responses_[i] = bestFeature.GetResponse(data_, indices_[i]);
-        if (responses_[i] < bestThreshold)
-          leftChildStatistics_.Aggregate(data_, indices_[i]);
-        else
-          rightChildStatistics_.Aggregate(data_, indices_[i]);
+        leftChildStatistics_ = threadLocalData_[bestThread].bestLeftStatistics_.DeepClone();
+        rightChildStatistics_ = threadLocalData_[bestThread].bestRightStatistics_.DeepClone();
       }
 
       if (trainingContext_.ShouldTerminate(parentStatistics_, leftChildStatistics_, rightChildStatistics_, maxGain))
@@ -258,24 +470,405 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       // Otherwise this is a new decision node, recurse for children.
       nodes[nodeIndex].InitializeSplit(bestFeature, bestThreshold, parentStatistics_);
 
-      // Now do partition sort - any sample with response greater goes left, otherwise right
-      DataPointIndex ii = Tree<F, S>::Partition(responses_, indices_, i0, i1, bestThreshold);
+      progress_[Verbose] << " (threshold = " << bestThreshold << ", gain = "<< maxGain << ")." << std::endl;
 
-      assert(ii >= i0 && i1 >= ii);
+      // The children reuse the members, so keep their statistics here
+      S leftStatistics = leftChildStatistics_.DeepClone();
+      S rightStatistics = rightChildStatistics_.DeepClone();
 
-      progress_[Verbose] << " (threshold = " << bestThreshold << ", gain = "<< maxGain << ")." << std::endl;
+      TrainNodesRecurse(nodes, nodeIndex * 2 + 1, i0, ii, recurseDepth + 1, &leftStatistics);
+      TrainNodesRecurse(nodes, nodeIndex * 2 + 2, ii, i1, recurseDepth + 1, &rightStatistics);
+    }
 
-      TrainNodesRecurse(nodes, nodeIndex * 2 + 1, i0, ii, recurseDepth + 1);
-      TrainNodesRecurse(nodes, nodeIndex * 2 + 2, ii, i1, recurseDepth + 1);
+    /// <summary>
+    /// Train the tree from indices_[0..count) a level at a time instead of
+    /// a node at a time. All the nodes of a level draw their candidates from
+    /// one pool of features, so each block of pool features is generated
+    /// once per level and then evaluated node by node. Honours
+    /// parameters_.MaxSamplesPerNode and FeatureBlockSize; pruning and
+    /// halving are rejected by TrainingParameters::Validate().
+    /// </summary>
+    void TrainLevels(std::vector<Node<F, S> >& nodes, DataPointIndex count)
+    {
+      std::vector<LevelNode> level, next;
+
+      LevelNode root;
+      root.nodeIndex = 0;
+      root.i0 = 0;
+      root.i1 = count;
+      root.statistics = trainingContext_.GetStatisticsAggregator();
+      for (DataPointIndex i = 0; i < count; i++)
+        root.statistics.Aggregate(data_, indices_[i]);
+      level.push_back(root);
+
+      for (unsigned int depth = 0; !level.empty(); depth++)
+      {
+        if (level[0].nodeIndex >= nodes.size() / 2) // these are leaf nodes, nothing else to do
+        {
+          for (size_t n = 0; n < level.size(); n++)
+          {
+            nodes[level[n].nodeIndex].InitializeLeaf(level[n].statistics);
+            progress_[Verbose] << Tree<F, S>::GetPrettyPrintPrefix(level[n].nodeIndex) << level[n].i1 - level[n].i0 << ": Terminating at max depth." << std::endl;
+          }
+          break;
+        }
+
+        for (int threadIndex = 0; threadIndex < maxThreads_; threadIndex++)
+          threadLocalData_[threadIndex].ClearLevel(level.size());
+
+        // Large nodes search a uniform subsample, drawn from the node's
+        // stream as TrainNodesRecurse would draw it
+        for (size_t n = 0; n < level.size(); n++)
+        {
+          LevelNode& node = level[n];
+          node.searchIndices = indices_.data() + node.i0;
+          node.searchCount = node.i1 - node.i0;
+          node.searchStatistics = &node.statistics;
+          if (parameters_.MaxSamplesPerNode > 0 && node.i1 - node.i0 > parameters_.MaxSamplesPerNode)
+          {
+            Random nodeRandom = random_.Stream((unsigned int)node.nodeIndex);
+            nodeRandom.ReservoirSample(indices_.data() + node.i0, node.i1 - node.i0, parameters_.MaxSamplesPerNode, node.sampleIndices);
+
+            node.sampleStatistics = trainingContext_.GetStatisticsAggregator();
+            for (DataPointIndex i = 0; i < node.sampleIndices.size(); i++)
+              node.sampleStatistics.Aggregate(data_, node.sampleIndices[i]);
+
+            node.searchIndices = node.sampleIndices.data();
+            node.searchCount = node.sampleIndices.size();
+            node.searchStatistics = &node.sampleStatistics;
+          }
+        }
+
+        Random levelRandom = random_.Stream(LevelRandomStream - depth);
+
+        // Iterate over blocks of the pool, sharing them out between threads.
+        // Thread scratch holds one node's responses to the block at a time.
+        int blockSize = FeatureBlockSize(parameters_.NumberOfCandidateFeatures);
+        int blockCount = (parameters_.NumberOfCandidateFeatures + blockSize - 1) / blockSize;
+        #pragma omp parallel for num_threads(maxThreads_) schedule(dynamic)
+        for (int block = 0; block < blockCount; block++)
+        {
+          ThreadLocalData& tl = threadLocalData_[omp_get_thread_num()]; // shorthand
+          int c0 = block * blockSize;
+          int c1 = std::min(c0 + blockSize, parameters_.NumberOfCandidateFeatures);
+
+          tl.blockFeatures_.clear();
+          for (int f = c0; f < c1; f++)
+          {
+            Random featureRandom = levelRandom.Stream(f);
+            tl.blockFeatures_.push_back(trainingContext_.GetRandomFeature(featureRandom));
+          }
+
+          for (size_t n = 0; n < level.size(); n++)
+          {
+            const LevelNode& node = level[n];
+            DataPointIndex searchCount = node.searchCount;
+
+            Response* rows = tl.ResponseRows(searchCount, c1 - c0);
+            F::GetResponses(data_, tl.blockFeatures_.data(), c1 - c0, node.searchIndices, (unsigned int)searchCount, rows, searchCount);
+
+            // Each node chooses its own thresholds from its own samples'
+            // responses, from the node's stream for this feature
+            Random nodeRandom = random_.Stream((unsigned int)node.nodeIndex);
+            for (int k = 0; k < c1 - c0; k++)
+            {
+              int f = c0 + k;
+              const F& feature = tl.blockFeatures_[k];
+              const Response* searchResponses = rows + k * searchCount;
+              Random thresholdRandom = nodeRandom.Stream(f);
+
+              int nThresholds;
+              if ((nThresholds = ChooseCandidateThresholds(thresholdRandom, 0, searchCount, searchResponses, tl.thresholds)) == 0)
+                continue;
+
+              for (unsigned int b = 0; b < parameters_.NumberOfCandidateThresholdsPerFeature + 1; b++)
+                tl.partitionStatistics_[b].Clear();
+
+              for (DataPointIndex i = 0; i < searchCount; i++)
+                tl.partitionStatistics_[FindPartition(tl.thresholds.data(), nThresholds, searchResponses[i])].Aggregate(data_, node.searchIndices[i]);
+
+              LevelSplit& best = tl.levelSplits_[n];
+              SweepThresholds(tl.partitionStatistics_, tl.suffixStatistics_, tl.leftChildStatistics_, nThresholds,
+                [&](int t, const S& left, const S& right)
+                {
+                  double gain = trainingContext_.ComputeInformationGain(*node.searchStatistics, left, right);
+
+                  // Ties go to the later candidate, as in TrainNodesRecurse
+                  if (gain > best.maxGain || (gain == best.maxGain && f >= best.featureIndex))
+                  {
+                    best.maxGain = gain;
+                    best.featureIndex = f;
+                    best.feature = feature;
+                    best.threshold = tl.thresholds[t];
+                  }
+                });
+            }
+          }
+        }
+
+        // Merge over threads, then split each node and queue its children
+        next.clear();
+        for (size_t n = 0; n < level.size(); n++)
+        {
+          const LevelNode& node = level[n];
+
+          LevelSplit best = threadLocalData_[0].levelSplits_[n];
+          for (int threadIndex = 1; threadIndex < maxThreads_; threadIndex++)
+          {
+            const LevelSplit& split = threadLocalData_[threadIndex].levelSplits_[n];
+            if (split.maxGain > best.maxGain || (split.maxGain == best.maxGain && split.featureIndex > best.featureIndex))
+              best = split;
+          }
+
+          progress_[Verbose] << Tree<F, S>::GetPrettyPrintPrefix(node.nodeIndex) << node.i1 - node.i0 << ": ";
+          if (node.searchStatistics != &node.statistics)
+            progress_[Verbose] << "(searching " << node.searchCount << ") ";
+
+          if (best.maxGain == 0.0)
+          {
+            nodes[node.nodeIndex].InitializeLeaf(node.statistics);
+            progress_[Verbose] << "Terminating with zero gain." << std::endl;
+            continue;
+          }
+
+          // Only the winning feature's responses are needed again
+          for (DataPointIndex i = node.i0; i < node.i1; i++)
+            responses_[i] = (Response)best.feature.GetResponse(data_, indices_[i]);
+
+          DataPointIndex ii = PartitionSamples(responses_, node.i0, node.i1, best.threshold);
+
+          assert(ii >= node.i0 && node.i1 >= ii);
+
+          SplitStatistics(node.statistics, node.i0, ii, node.i1, leftChildStatistics_, rightChildStatistics_);
+
+          if (trainingContext_.ShouldTerminate(node.statistics, leftChildStatistics_, rightChildStatistics_, best.maxGain))
+          {
+            nodes[node.nodeIndex].InitializeLeaf(node.statistics);
+            progress_[Verbose] << "Terminating with no split." << std::endl;
+            continue;
+          }
+
+          nodes[node.nodeIndex].InitializeSplit(best.feature, best.threshold, node.statistics);
+
+          progress_[Verbose] << " (threshold = " << best.threshold << ", gain = "<< best.maxGain << ")." << std::endl;
+
+          LevelNode child;
+          child.nodeIndex = node.nodeIndex * 2 + 1;
+          child.i0 = node.i0;
+          child.i1 = ii;
+          child.statistics = leftChildStatistics_.DeepClone();
+          next.push_back(child);
+
+          child.nodeIndex = node.nodeIndex * 2 + 2;
+          child.i0 = ii;
+          child.i1 = node.i1;
+          child.statistics = rightChildStatistics_.DeepClone();
+          next.push_back(child);
+        }
+
+        level.swap(next);
+      }
     }
 
   private:
+    /// <summary>
+    /// Number of candidate features evaluated together when there are
+    /// candidateCount of them: parameters_.FeatureBlockSize, but small
+    /// enough that every thread gets a block.
+    /// </summary>
+    int FeatureBlockSize(int candidateCount) const
+    {
+      int perThread = (candidateCount + maxThreads_ - 1) / maxThreads_;
+      return std::max(1, std::min((int)parameters_.FeatureBlockSize, perThread));
+    }
+
+    /// <summary>
+    /// The best gain a feature achieves over samples[0..count), whose
+    /// statistics are given, using the thread's scratch storage. Used to
+    /// estimate a candidate's gain from a sample.
+    /// </summary>
+    double EstimateGain(ThreadLocalData& tl, const F& feature, Random& random, const unsigned int* samples, DataPointIndex count, const S& statistics, Response* responses)
+    {
+      for (unsigned int b = 0; b < parameters_.NumberOfCandidateThresholdsPerFeature + 1; b++)
+        tl.partitionStatistics_[b].Clear();
+
+      for (DataPointIndex i = 0; i < count; i++)
+        responses[i] = (Response)feature.GetResponse(data_, samples[i]);
+
+      int nThresholds;
+      if ((nThresholds = ChooseCandidateThresholds(random, 0, count, responses, tl.thresholds)) == 0)
+        return 0.0;
+
+      for (DataPointIndex i = 0; i < count; i++)
+        tl.partitionStatistics_[FindPartition(tl.thresholds.data(), nThresholds, responses[i])].Aggregate(data_, samples[i]);
+
+      double maxGain = 0.0;
+      SweepThresholds(tl.partitionStatistics_, tl.suffixStatistics_, tl.leftChildStatistics_, nThresholds,
+        [&](int, const S& left, const S& right)
+        {
+          maxGain = std::max(maxGain, trainingContext_.ComputeInformationGain(statistics, left, right));
+        });
+
+      return maxGain;
+    }
+
+    /// <summary>
+    /// Score every candidate feature on a random sample of the search
+    /// samples, into gainEstimates_, as TreeTrainingOperation does. Like it,
+    /// the cutoff is a heuristic and may prune the true winner. The
+    /// candidates are shared out between threads, but which are pruned
+    /// doesn't depend on the threads.
+    /// </summary>
+    /// <returns>Estimates below this needn't be evaluated in full.</returns>
+    double PruneCandidates(const Random& nodeRandom, const unsigned int* searchIndices, DataPointIndex searchCount)
+    {
+      std::fill(gainEstimates_.begin(), gainEstimates_.end(), 0.0);
+
+      double range = trainingContext_.GainRange();
+      if (parameters_.PruneSampleSize == 0 || searchCount <= 2 * parameters_.PruneSampleSize || range <= 0.0)
+        return -std::numeric_limits<double>::infinity();
+
+      Random pruneRandom = nodeRandom.Stream(PruneRandomStream);
+      pruneRandom.ReservoirSample(searchIndices, searchCount, parameters_.PruneSampleSize, pruneIndices_);
+
+      pruneStatistics_.Clear();
+      for (DataPointIndex i = 0; i < pruneIndices_.size(); i++)
+        pruneStatistics_.Aggregate(data_, pruneIndices_[i]);
+
+      #pragma omp parallel for num_threads(maxThreads_) schedule(dynamic)
+      for (int f = 0; f < parameters_.NumberOfCandidateFeatures; f++)
+      {
+        ThreadLocalData& tl = threadLocalData_[omp_get_thread_num()];
+
+        // The feature is drawn exactly as the full evaluation draws it
+        Random featureRandom = nodeRandom.Stream(f);
+        F feature = trainingContext_.GetRandomFeature(featureRandom);
+        gainEstimates_[f] = EstimateGain(tl, feature, featureRandom, pruneIndices_.data(), pruneIndices_.size(), pruneStatistics_, tl.ResponseRows(pruneIndices_.size(), 1));
+      }
+
+      double bestEstimate = *std::max_element(gainEstimates_.begin(), gainEstimates_.end());
+      double margin = range * sqrt(log(1.0 / parameters_.PruneFailureProbability) / (2.0 * pruneIndices_.size()));
+      double cutoff = bestEstimate - 2.0 * margin;
+
+      int pruned = 0;
+      for (int f = 0; f < parameters_.NumberOfCandidateFeatures; f++)
+        if (gainEstimates_[f] < cutoff)
+          pruned++;
+      progress_[Verbose] << "(pruned " << pruned << ") ";
+
+      return cutoff;
+    }
+
+    /// <summary>
+    /// Successive halving: score the candidates still in candidates_ on a
+    /// random sample of the search samples, keep the better half and double
+    /// the sample, until one candidate is left or the sample would be the
+    /// whole node. Each round's sample comes from its own stream, so the
+    /// survivors don't depend on the threads.
+    /// </summary>
+    void HalveCandidates(const Random& nodeRandom, const unsigned int* searchIndices, DataPointIndex searchCount)
+    {
+      candidates_.clear();
+      for (int f = 0; f < parameters_.NumberOfCandidateFeatures; f++)
+        candidates_.push_back(f);
+
+      DataPointIndex sampleSize = parameters_.HalvingSampleSize;
+      for (unsigned int round = 0; candidates_.size() > 1 && sampleSize < searchCount; round++, sampleSize *= 2)
+      {
+        Random halvingRandom = nodeRandom.Stream(HalvingRandomStream - round);
+        halvingRandom.ReservoirSample(searchIndices, searchCount, (unsigned int)sampleSize, pruneIndices_);
+
+        pruneStatistics_.Clear();
+        for (DataPointIndex i = 0; i < pruneIndices_.size(); i++)
+          pruneStatistics_.Aggregate(data_, pruneIndices_[i]);
+
+        #pragma omp parallel for num_threads(maxThreads_) schedule(dynamic)
+        for (int c = 0; c < (int)candidates_.size(); c++)
+        {
+          ThreadLocalData& tl = threadLocalData_[omp_get_thread_num()];
+
+          // The feature is drawn exactly as the full evaluation draws it
+          int f = candidates_[c];
+          Random featureRandom = nodeRandom.Stream(f);
+          F feature = trainingContext_.GetRandomFeature(featureRandom);
+          gainEstimates_[f] = EstimateGain(tl, feature, featureRandom, pruneIndices_.data(), pruneIndices_.size(), pruneStatistics_, tl.ResponseRows(pruneIndices_.size(), 1));
+        }
+
+        // Keep the better half, breaking ties in favour of the later
+        // candidate as the full evaluation does
+        const std::vector<double>& estimates = gainEstimates_;
+        std::sort(candidates_.begin(), candidates_.end(), [&estimates](int a, int b)
+        {
+          return estimates[a] > estimates[b] || (estimates[a] == estimates[b] && a > b);
+        });
+        candidates_.resize((candidates_.size() + 1) / 2);
+        std::sort(candidates_.begin(), candidates_.end());
+      }
+
+      progress_[Verbose] << "(halved to " << candidates_.size() << ") ";
+    }
+
+    /// <summary>
+    /// Partition the samples indices_[i0..i1) and their responses on the
+    /// threshold, stably if parameters_.StablePartition is set, in which
+    /// case ranges of Tree::ParallelPartitionSize or more are partitioned on
+    /// every thread with the same result. Otherwise Tree::Partition keeps
+    /// the order trees have always been grown with, so the scratch vectors
+    /// are only used in stable mode.
+    /// </summary>
+    DataPointIndex PartitionSamples(std::vector<Response>& responses, DataPointIndex i0, DataPointIndex i1, float threshold)
+    {
+      if (parameters_.StablePartition)
+        return Tree<F, S>::ParallelPartition(responses, indices_, i0, i1, threshold, partitionResponses_, partitionIndices_, maxThreads_);
+      else
+        return Tree<F, S>::Partition(responses, indices_, i0, i1, threshold);
+    }
+
+    /// <summary>
+    /// Statistics of the children indices_[i0..ii) and indices_[ii..i1) of
+    /// a node with the given statistics. Aggregates the smaller child only
+    /// and derives its sibling with Subtract.
+    /// </summary>
+    void SplitStatistics(const S& parent, DataPointIndex i0, DataPointIndex ii, DataPointIndex i1, S& left, S& right)
+    {
+      bool leftSmaller = ii - i0 <= i1 - ii;
+      S& smaller = leftSmaller ? left : right;
+      S& larger = leftSmaller ? right : left;
+
+      smaller.Clear();
+      for (DataPointIndex i = (leftSmaller ? i0 : ii); i < (leftSmaller ? ii : i1); i++)
+        smaller.Aggregate(data_, indices_[i]);
+
+      larger = parent.DeepClone();
+      larger.Subtract(smaller);
+    }
+
+    /// <summary>
+    /// The partition a response falls in for the candidate thresholds
+    /// thresholds[0..nThresholds), which are ascending: the number of
+    /// thresholds the response is >= to. A branchless binary search, so the
+    /// cost is log2(nThresholds) steps without mispredictions.
+    /// </summary>
+    static int FindPartition(const float* thresholds, int nThresholds, float response)
+    {
+      const float* base = thresholds;
+      int n = nThresholds;
+      while (n > 1)
+      {
+        int half = n / 2;
+        base = (response >= base[half]) ? base + half : base;
+        n -= half;
+      }
+
+      return (int)(base - thresholds) + (response >= *base ? 1 : 0);
+    }
+
+    template<class R>
     int ChooseCandidateThresholds (
       Random& random,
-      unsigned int* dataIndices, 
       DataPointIndex i0,
       DataPointIndex i1,
-      const float* responses,
+      const R* responses,
       std::vector<float>& thresholds )
     {
       thresholds.resize(parameters_.NumberOfCandidateThresholdsPerFeature + 1);
@@ -298,14 +891,14 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       }
 
       // Sort the response values to form approximate quantiles.
-      std::sort(quantiles.begin(), quantiles.end());
+      std::sort(quantiles.begin(), quantiles.begin() + nThresholds + 1); // only the values written above
 
       if (quantiles[0] == quantiles[nThresholds])
         return 0;   // all sampled response values were the same
 
       // Compute n candidate thresholds by sampling in between n+1 approximate quantiles
       for (int i = 0; i < nThresholds; i++)
-        thresholds[i] = quantiles[i] + (float)(random_.NextDouble() * (quantiles[i + 1] - quantiles[i]));
+        thresholds[i] = quantiles[i] + (float)(random.NextDouble() * (quantiles[i + 1] - quantiles[i]));
 
       return nThresholds;
     }
@@ -324,33 +917,44 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     /// Train a new decision tree given some training data and a training
     /// problem described by an ITrainingContext instance.
     /// </summary>
-    /// <param name="random">The single random number generator.</param>
+    /// <param name="random">The tree's random number generator. Node and
+    /// feature streams are derived from it with Random::Stream().</param>
     /// <param name="progress">Progress reporting target.</param>
     /// <param name="context">The ITrainingContext instance by which
     /// the training framework interacts with the training data.
     /// Implemented within client code.</param>
     /// <param name="parameters">Training parameters. This includes max_threads</param>
     /// <param name="data">The training data.</param>
+    /// <param name="dataIndices">Optional subset of the data to train on,
+    /// e.g. a bag drawn by an IDataPointSampler. By default every data point
+    /// is used.</param>
     /// <returns>A new decision tree.</returns>
     static std::unique_ptr<Tree<F, S> > TrainTree(
       Random& random,
       ITrainingContext<F, S>& context,
       const TrainingParameters& parameters,
       const IDataPointCollection& data,
-      ProgressStream* progress=0)
+      ProgressStream* progress=0,
+      const std::vector<unsigned int>* dataIndices=0)
     {
+      parameters.Validate();
+
       ProgressStream defaultProgress(std::cout, parameters.Verbose? Verbose:Interest);
       if(progress==0)
         progress=&defaultProgress;
 
       
-      ParallelTreeTrainingOperation<F, S> trainingOperation(random, context, parameters, data, *progress);
+      ParallelTreeTrainingOperation<F, S> trainingOperation(random, context, parameters, data, *progress, dataIndices);
       
       std::unique_ptr<Tree<F, S> > tree = std::unique_ptr<Tree<F, S> >(new Tree<F,S>(parameters.MaxDecisionLevels));
 
       (*progress)[Verbose] << std::endl;
       
-      trainingOperation.TrainNodesRecurse(tree->GetNodes(), 0, 0, data.Count(), 0);  // will recurse until termination criterion is met
+      unsigned int count = dataIndices != 0 ? (unsigned int)dataIndices->size() : data.Count();
+      if (parameters.SharedFeaturePool)
+        trainingOperation.TrainLevels(tree->GetNodes(), count);
+      else
+        trainingOperation.TrainNodesRecurse(tree->GetNodes(), 0, 0, count, 0);  // will recurse until termination criterion is met
 
       (*progress)[Verbose] << std::endl;
 
@@ -376,26 +980,58 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     /// <param name="context">An ITrainingContext instance describing
     /// the training problem, e.g. classification, density estimation, etc. </param>
     /// <param name="data">The training data.</param>
+    /// <param name="sampler">Optional IDataPointSampler which draws each
+    /// tree's training subset (bagging). By default every tree sees all the data.</param>
+    /// <param name="checkpoint">Optional ForestCheckpoint. Trees already in
+    /// it are loaded instead of trained, and each newly trained tree is
+    /// written to it as soon as it's finished.</param>
     /// <returns>A new decision forest.</returns>
     static std::unique_ptr<Forest<F,S> > TrainForest(
       Random& random,
       const TrainingParameters& parameters,
       ITrainingContext<F,S>& context,
       const IDataPointCollection& data,
-      ProgressStream* progress=0)
+      ProgressStream* progress=0,
+      const IDataPointSampler* sampler=0,
+      ForestCheckpoint<F,S>* checkpoint=0)
     {
+      parameters.Validate();
+
       ProgressStream defaultProgress(std::cout, parameters.Verbose? Verbose:Interest);
       if(progress==0)
         progress=&defaultProgress;
       
       std::unique_ptr<Forest<F,S> > forest = std::unique_ptr<Forest<F,S> >(new Forest<F,S>());
+      Random forestRandom(checkpoint != 0 ? checkpoint->Begin(random, parameters) : random.Key());
       
       for (int t = 0; t < parameters.NumberOfTrees; t++)
       {
+        if (checkpoint != 0 && checkpoint->HasTree(t))
+        {
+          (*progress)[Interest] << "\rResuming tree "<< t << " from checkpoint...";
+          if (checkpoint->KeepTrees())
+            forest->AddTree(checkpoint->LoadTree(t));
+          continue;
+        }
+
         (*progress)[Interest] << "\rTraining tree "<< t << "...";
       
-        std::unique_ptr<Tree<F, S> > tree = ParallelTreeTrainer<F, S>::TrainTree(random, context, parameters, data, progress);
-        forest->AddTree(std::move(tree));
+        Random treeRandom = forestRandom.Stream(t);
+        std::unique_ptr<Tree<F, S> > tree;
+        if (sampler != 0)
+        {
+          std::vector<unsigned int> bag;
+          Random bagRandom = treeRandom.Stream(IDataPointSampler::RandomStream);
+          sampler->Sample(bagRandom, bag);
+          tree = ParallelTreeTrainer<F, S>::TrainTree(treeRandom, context, parameters, data, progress, &bag);
+        }
+        else
+          tree = ParallelTreeTrainer<F, S>::TrainTree(treeRandom, context, parameters, data, progress);
+
+        if (checkpoint != 0)
+          checkpoint->SaveTree(t, *tree);
+        if (checkpoint == 0 || checkpoint->KeepTrees())
+          forest->AddTree(std::move(tree));
       }
       (*progress)[Interest] << "\rTrained " << parameters.NumberOfTrees << " trees.         " << std::endl;
 
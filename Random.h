@@ -5,10 +5,17 @@
 // Should work just the same though.
 // This files defines the Random class, used throughout the forest training
 // framework for random number generation.
+// Training never shares a Random between threads. Instead each tree, node and
+// candidate feature draws from its own stream, derived from the forest seed
+// with Stream(), so a given seed always grows the same forest regardless of
+// the number of threads or the order in which they are scheduled.
 
 #include <time.h>
 #include <cstdlib>
 #include <iostream> 
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
 
 namespace MicrosoftResearch {
   namespace Cambridge {
@@ -20,10 +27,42 @@ namespace MicrosoftResearch {
       {
       public:
         Random() : seed((unsigned int)(time(NULL))), a(214013), c(2531011), m(2147483648)
-        {}
+        {
+          key = seed;
+        }
 
         Random(unsigned int s) : seed(s), a(214013), c(2531011), m(2147483648)
-        {}
+        {
+          key = seed;
+        }
+
+        /// <summary>
+        /// The seed this generator was constructed with. Not affected by
+        /// drawing numbers, so can be reported and used to reproduce a run.
+        /// </summary>
+        unsigned int Key() const
+        {
+          return key;
+        }
+
+        /// <summary>
+        /// Returns an independent generator for the numbered sub-stream of
+        /// this generator. The result depends only on this generator's
+        /// construction seed and the stream number (not on how many numbers
+        /// have been drawn), so it is safe to call concurrently.
+        /// </summary>
+        /// <param name="stream">Sub-stream number, e.g. a tree or node index.</param>
+        Random Stream(unsigned int stream) const
+        {
+          // SplitMix64 finalizer over (key, stream) as a 64 bit counter
+          unsigned long long z = ((unsigned long long)key << 32) | stream;
+          z += 0x9E3779B97F4A7C15ULL;
+          z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+          z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+          z = z ^ (z >> 31);
+
+          return Random((unsigned int)(z ^ (z >> 32)));
+        }
 
         int Next() {
           return(seed = (a * seed + c) % m);
@@ -39,6 +78,29 @@ namespace MicrosoftResearch {
           return minValue + Next() % (maxValue - minValue);
         }
 
+        /// <summary>
+        /// Returns an integer uniformly distributed in [0, bound), for bounds
+        /// past the range of int, e.g. positions in a large array. Draws that
+        /// would favour the low values are rejected. Bounds over 2^31 combine
+        /// two draws, so bound must be at most 2^62.
+        /// </summary>
+        unsigned long long NextIndex(unsigned long long bound)
+        {
+          if (bound <= m)
+          {
+            unsigned int limit = m - (unsigned int)(m % bound);
+            unsigned int r;
+            do r = (unsigned int)Next(); while (r >= limit);
+            return r % bound;
+          }
+
+          const unsigned long long range = (unsigned long long)m * m;
+          unsigned long long limit = range - range % bound;
+          unsigned long long r;
+          do r = (unsigned long long)Next() * m + (unsigned int)Next(); while (r >= limit);
+          return r % bound;
+        }
+
         std::vector<int> RandomVector(int minValue, int maxValue, int length, bool replacement)
         {
           if((maxValue - minValue < length)&&!replacement)
@@ -68,10 +130,34 @@ namespace MicrosoftResearch {
           return random_vec;
         }
 
+        /// <summary>
+        /// Draws a uniform sample of k values without replacement using
+        /// reservoir sampling (Algorithm R). The sample keeps the order of
+        /// values for the first k entries, later entries replace random slots.
+        /// If there are k or fewer values, all of them are returned.
+        /// </summary>
+        /// <param name="values">The values to sample from.</param>
+        /// <param name="count">Number of values.</param>
+        /// <param name="k">Reservoir size.</param>
+        /// <param name="sample">Output, resized to min(k, count).</param>
+        void ReservoirSample(const unsigned int* values, size_t count, unsigned int k, std::vector<unsigned int>& sample)
+        {
+          size_t n = count < k ? count : k;
+          sample.assign(values, values + n);
+
+          for (size_t i = n; i < count; i++)
+          {
+            size_t j = (size_t)NextIndex(i + 1);
+            if (j < n)
+              sample[j] = values[i];
+          }
+        }
+
       private:
         const int a, c;
         const unsigned int m;
         unsigned int seed;
+        unsigned int key;
       };
 
     }
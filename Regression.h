@@ -13,8 +13,12 @@
 namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 {
 
-    template<class F>
-    class RegressionTrainingContext : public ITrainingContext<F, DiffEntropyAggregator> // where F:IFeatureResponse
+    /// <summary>
+    /// Regression training context. S is the statistics aggregator, either
+    /// DiffEntropyAggregator or MomentsAggregator.
+    /// </summary>
+    template<class F, class S = DiffEntropyAggregator>
+    class RegressionTrainingContext : public ITrainingContext<F, S> // where F:IFeatureResponse
     {
     private:
         int nClasses_;
@@ -34,13 +38,13 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
             return featureFactory_->CreateRandom(random);
         }
 
-        DiffEntropyAggregator GetStatisticsAggregator()
+        S GetStatisticsAggregator()
         {
-            return DiffEntropyAggregator();
+            return S();
         }
 
         // Calculates the change in entropy (entropy defined in DiffEntropyAggregator) 
-        double ComputeInformationGain(const DiffEntropyAggregator& allStatistics, const DiffEntropyAggregator& leftStatistics, const DiffEntropyAggregator& rightStatistics)
+        double ComputeInformationGain(const S& allStatistics, const S& leftStatistics, const S& rightStatistics)
         {
             double entropyBefore = allStatistics.DifferentialEntropy();
 
@@ -54,16 +58,57 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
             return entropyBefore - entropyAfter;
         }
 
-        bool ShouldTerminate(const DiffEntropyAggregator& parent, const DiffEntropyAggregator& leftChild, const DiffEntropyAggregator& rightChild, double gain)
+        bool ShouldTerminate(const S& parent, const S& leftChild, const S& rightChild, double gain)
         {
             return gain < 0.01;
         }
     };
 
+    /// <summary>
+    /// Regression training context that splits on plain variance reduction
+    /// rather than differential entropy. Gain is the fraction of the
+    /// parent's sum of squared errors the split removes, so it needs no logs
+    /// and, being scale free, shares the 0.01 termination threshold.
+    /// </summary>
+    template<class F, class S = DiffEntropyAggregator>
+    class VarianceRegressionTrainingContext : public RegressionTrainingContext<F, S> // where F:IFeatureResponse
+    {
+    public:
+        VarianceRegressionTrainingContext(IFeatureResponseFactory<F>* featureFactory)
+            : RegressionTrainingContext<F, S>(featureFactory)
+        {
+        }
+
+    private:
+        double ComputeInformationGain(const S& allStatistics, const S& leftStatistics, const S& rightStatistics)
+        {
+            unsigned int nTotalSamples = leftStatistics.SampleCount() + rightStatistics.SampleCount();
+
+            if (nTotalSamples <= 1)
+                return 0.0;
+
+            double sseBefore = allStatistics.SumSquaredError();
+            if (sseBefore <= 0.0)
+                return 0.0;
+
+            double sseAfter = leftStatistics.SumSquaredError() + rightStatistics.SumSquaredError();
+
+            return (sseBefore - sseAfter) / sseBefore;
+        }
+
+        // A fraction of the parent's SSE. Differential entropy gain has no
+        // such bound, so only this context supports pruning.
+        double GainRange()
+        {
+            return 1.0;
+        }
+    };
+
     /// <summary>
     /// A class for construction and application of regression based decision trees.
+    /// S is the statistics aggregator, see RegressionTrainingContext.
     /// </summary>
-    template<class F>
+    template<class F, class S = DiffEntropyAggregator>
     class Regressor
     {
     public:
@@ -71,25 +116,37 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         /// Create and train a Regression forest (DiffEntropy statistics) 
         /// If OpenMP is compiled, this function parallelises by evaluating node responses in parallel
         /// training one tree at a time.
+        /// If a checkpoint is given, finished trees are resumed from and
+        /// saved to it (see ForestCheckpoint).
         /// </summary>
-        static std::unique_ptr<Forest<F, DiffEntropyAggregator> > TrainPar(
+        static std::unique_ptr<Forest<F, S> > TrainPar(
             const DataPointCollection& trainingData,
-            const TrainingParameters& TrainingParameters) // where F : IFeatureResponse
+            const TrainingParameters& TrainingParameters,
+            ForestCheckpoint<F, S>* checkpoint = 0) // where F : IFeatureResponse
         {
 
             if (trainingData.HasTargetValues() == false)
                 throw std::runtime_error("Training data points must have target values.");
 
-            // For random number generation.
-            Random random;
+            // For random number generation. Every tree, node and feature
+            // gets its own stream derived from this seed.
+            Random random = TrainingParameters.RandomSeed < 0 ? Random() : Random(TrainingParameters.RandomSeed);
             FeatureFactory<F> featureFactory(trainingData.Dimensions());
-            RegressionTrainingContext<F> regressionContext(&featureFactory);
+            RegressionTrainingContext<F, S> entropyContext(&featureFactory);
+            VarianceRegressionTrainingContext<F, S> varianceContext(&featureFactory);
+            RegressionTrainingContext<F, S>& regressionContext = TrainingParameters.SplitCriterion == SplitCriterionDescriptor::Variance ?
+                varianceContext : entropyContext;
             ProgressStream progress_stream(std::cout, Interest);
             if (TrainingParameters.Verbose)
                 progress_stream.makeVerbose();
+            progress_stream[Interest] << "Random seed: " << random.Key() << std::endl;
+
+            // Trees train on whole-image bags of the shared data, if asked
+            ImageBagSampler sampler(trainingData, TrainingParameters.BagFraction, TrainingParameters.BagBootstrap);
 
-            std::unique_ptr<Forest<F, DiffEntropyAggregator> > forest = ParallelForestTrainer<F, DiffEntropyAggregator>::TrainForest(
-                random, TrainingParameters, regressionContext, trainingData, &progress_stream);
+            std::unique_ptr<Forest<F, S> > forest = ParallelForestTrainer<F, S>::TrainForest(
+                random, TrainingParameters, regressionContext, trainingData, &progress_stream,
+                TrainingParameters.Bagging() ? &sampler : 0, checkpoint);
 
             return forest;
         }
@@ -103,7 +160,7 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         /// will put the trees out of scope. To avoid this, use a ForestShared
         /// object instead.
         /// </summary>
-        static std::vector<uint16_t> ApplyMat(Forest<F, DiffEntropyAggregator>& forest, const DataPointCollection& regressData)
+        static std::vector<uint16_t> ApplyMat(Forest<F, S>& forest, const DataPointCollection& regressData)
         {
             unsigned int samples = regressData.Count();
             std::vector<uint16_t> ret(samples);
@@ -111,15 +168,14 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
             for (unsigned int t = 0; t < forest.TreeCount(); t++)
             {
                 std::vector<int> leafNodeIndices;
-                std::shared_ptr<Tree<F, DiffEntropyAggregator> > tree = forest.GetTreeShared(t);
+                std::shared_ptr<Tree<F, S> > tree = forest.GetTreeShared(t);
                 tree->Apply(regressData, leafNodeIndices);
 
                 for (unsigned int i = 0; i < regressData.Count(); i++)
                 {
-                    // TODO potentially remove this declaration if it's taking too much time
-                    DiffEntropyAggregator agg = tree->GetNode(leafNodeIndices[i]).TrainingDataStatistics;
+                    const S& agg = tree->GetNode(leafNodeIndices[i]).TrainingDataStatistics;
 
-                    ret[i] = uint16_t(round(agg.mean_));
+                    ret[i] = uint16_t(round(agg.GetMean()));
                 }
             }
 
@@ -132,7 +188,7 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         /// returns a std::vector where each element corresponds to an input pixel's
         /// probability distribution's mean value. 
         /// </summary>
-        static std::vector<uint16_t> ApplyMat(ForestShared<F, DiffEntropyAggregator>& forest, const DataPointCollection& regressData)
+        static std::vector<uint16_t> ApplyMat(ForestShared<F, S>& forest, const DataPointCollection& regressData)
         {
             unsigned int samples = regressData.Count();
             std::vector<uint16_t> ret(samples);
@@ -140,14 +196,14 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
             for (unsigned int t = 0; t < forest.TreeCount(); t++)
             {
                 std::vector<int> leafNodeIndices;
-                Tree<F, DiffEntropyAggregator>& tree = forest.GetTree(t);
+                Tree<F, S>& tree = forest.GetTree(t);
                 tree.Apply(regressData, leafNodeIndices);
 
                 for (unsigned int i = 0; i < regressData.Count(); i++)
                 {
-                    DiffEntropyAggregator agg = tree.GetNode(leafNodeIndices[i]).TrainingDataStatistics;
+                    const S& agg = tree.GetNode(leafNodeIndices[i]).TrainingDataStatistics;
 
-                    ret[i] = uint16_t(round(agg.mean_));
+                    ret[i] = uint16_t(round(agg.GetMean()));
                 }
             }
 
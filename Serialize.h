@@ -89,6 +89,34 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
         }
 
+        template<>
+        static void Serialize_<BoxDifferenceResponse>(std::ostream& o, const BoxDifferenceResponse& b)
+        {
+            binary_write(o, b.dimensions);
+            binary_write(o, b.box_0.x);
+            binary_write(o, b.box_0.y);
+            binary_write(o, b.box_0.width);
+            binary_write(o, b.box_0.height);
+            binary_write(o, b.box_1.x);
+            binary_write(o, b.box_1.y);
+            binary_write(o, b.box_1.width);
+            binary_write(o, b.box_1.height);
+        }
+
+        template<>
+        static void Deserialize_<BoxDifferenceResponse>(std::istream& o, BoxDifferenceResponse& b)
+        {
+            binary_read(o, b.dimensions);
+            binary_read(o, b.box_0.x);
+            binary_read(o, b.box_0.y);
+            binary_read(o, b.box_0.width);
+            binary_read(o, b.box_0.height);
+            binary_read(o, b.box_1.x);
+            binary_read(o, b.box_1.y);
+            binary_read(o, b.box_1.width);
+            binary_read(o, b.box_1.height);
+        }
+
         template<>
         static void Serialize_<HistogramAggregator>(std::ostream& o, const HistogramAggregator& b)
         {
@@ -106,13 +134,41 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         {
             binary_read(o, b.binCount_);
             binary_read(o, b.sampleCount_);
-            b.bins_.resize(b.binCount_);
+            if (b.binCount_ > MAX_BINS)
+                throw std::runtime_error("HistogramAggregator has more bins than MAX_BINS.");
 
             for (unsigned int i = 0; i < b.binCount_; i++)
             {
                 binary_read(o, b.bins_[i]);
             }
         }
+
+        // Written as a DiffEntropyAggregator (mean, sse, var, count), so
+        // forests trained with either read back the same way
+        template<>
+        static void Serialize_<MomentsAggregator>(std::ostream& o, const MomentsAggregator& b)
+        {
+            binary_write(o, b.GetMean());
+            binary_write(o, (float)b.SumSquaredError());
+            binary_write(o, (float)b.Variance());
+            binary_write(o, b.sample_count_);
+        }
+
+        template<>
+        static void Deserialize_<MomentsAggregator>(std::istream& o, MomentsAggregator& b)
+        {
+            float mean, sse, var;
+            binary_read(o, mean);
+            binary_read(o, sse);
+            binary_read(o, var);
+            binary_read(o, b.sample_count_);
+
+            // Rebuild the moments from what was stored (exact for the count
+            // and, up to float rounding, for the mean)
+            double sum = (double)mean * b.sample_count_;
+            b.sum_ = (unsigned long long)llround(sum);
+            b.sumSquares_ = b.sample_count_ == 0 ? 0 : (unsigned long long)llround(sse + sum * sum / b.sample_count_);
+        }
     // If it's not MS Visual C++, it doesn't like static in these 
     // explicit template instances. 
     #else
@@ -165,6 +221,34 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
         }
 
+        template<>
+        void Serialize_<BoxDifferenceResponse>(std::ostream& o, const BoxDifferenceResponse& b)
+        {
+            binary_write(o, b.dimensions);
+            binary_write(o, b.box_0.x);
+            binary_write(o, b.box_0.y);
+            binary_write(o, b.box_0.width);
+            binary_write(o, b.box_0.height);
+            binary_write(o, b.box_1.x);
+            binary_write(o, b.box_1.y);
+            binary_write(o, b.box_1.width);
+            binary_write(o, b.box_1.height);
+        }
+
+        template<>
+        void Deserialize_<BoxDifferenceResponse>(std::istream& o, BoxDifferenceResponse& b)
+        {
+            binary_read(o, b.dimensions);
+            binary_read(o, b.box_0.x);
+            binary_read(o, b.box_0.y);
+            binary_read(o, b.box_0.width);
+            binary_read(o, b.box_0.height);
+            binary_read(o, b.box_1.x);
+            binary_read(o, b.box_1.y);
+            binary_read(o, b.box_1.width);
+            binary_read(o, b.box_1.height);
+        }
+
         template<>
         void Serialize_<HistogramAggregator>(std::ostream& o, const HistogramAggregator& b)
         {
@@ -182,13 +266,41 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         {
             binary_read(o, b.binCount_);
             binary_read(o, b.sampleCount_);
-            b.bins_.resize(b.binCount_);
+            if (b.binCount_ > MAX_BINS)
+                throw std::runtime_error("HistogramAggregator has more bins than MAX_BINS.");
 
             for (unsigned int i = 0; i < b.binCount_; i++)
             {
                 binary_read(o, b.bins_[i]);
             }
         }
+
+        // Written as a DiffEntropyAggregator (mean, sse, var, count), so
+        // forests trained with either read back the same way
+        template<>
+        void Serialize_<MomentsAggregator>(std::ostream& o, const MomentsAggregator& b)
+        {
+            binary_write(o, b.GetMean());
+            binary_write(o, (float)b.SumSquaredError());
+            binary_write(o, (float)b.Variance());
+            binary_write(o, b.sample_count_);
+        }
+
+        template<>
+        void Deserialize_<MomentsAggregator>(std::istream& o, MomentsAggregator& b)
+        {
+            float mean, sse, var;
+            binary_read(o, mean);
+            binary_read(o, sse);
+            binary_read(o, var);
+            binary_read(o, b.sample_count_);
+
+            // Rebuild the moments from what was stored (exact for the count
+            // and, up to float rounding, for the mean)
+            double sum = (double)mean * b.sample_count_;
+            b.sum_ = (unsigned long long)llround(sum);
+            b.sumSquares_ = b.sample_count_ == 0 ? 0 : (unsigned long long)llround(sse + sum * sum / b.sample_count_);
+        }
     #endif
 
 
@@ -8,6 +8,7 @@
 #include "Random.h"
 
 #include "Forest.h"
+#include "ForestCheckpoint.h"
 #include "Tree.h"
 #include "Node.h"
 
@@ -1,8 +1,60 @@
+#include <algorithm>
+
 #include "StatisticsAggregators.h"
 
 
 namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 {
+    // n log2 n for counts below NLOG2N_TABLE_SIZE. Most histograms
+    // scored during training are at nodes small enough to be covered.
+    #define NLOG2N_TABLE_SIZE 65536
+
+    namespace
+    {
+        struct NLog2NTable
+        {
+            double values[NLOG2N_TABLE_SIZE];
+
+            NLog2NTable()
+            {
+                values[0] = 0.0;
+                for (unsigned int n = 1; n < NLOG2N_TABLE_SIZE; n++)
+                    values[n] = n * log2((double)n);
+            }
+        };
+
+        const NLog2NTable nLog2NTable;
+    }
+
+    double HistogramAggregator::NLog2N(unsigned int n)
+    {
+        if (n < NLOG2N_TABLE_SIZE)
+            return nLog2NTable.values[n];
+
+        return n * log2((double)n);
+    }
+
+    double HistogramAggregator::WeightedEntropy() const
+    {
+        double result = NLog2N(sampleCount_);
+        for (unsigned int b = 0; b < BinCount(); b++)
+            result -= NLog2N(bins_[b]);
+
+        return result;
+    }
+
+    double HistogramAggregator::WeightedGini() const
+    {
+        if (sampleCount_ == 0)
+            return 0.0;
+
+        unsigned long long sumSquares = 0;
+        for (unsigned int b = 0; b < BinCount(); b++)
+            sumSquares += (unsigned long long)bins_[b] * bins_[b];
+
+        return sampleCount_ - (double)sumSquares / sampleCount_;
+    }
+
     // Calculates Shannon entropy
     double HistogramAggregator::Entropy() const
     {
@@ -22,7 +74,7 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     HistogramAggregator::HistogramAggregator()
     {
         binCount_ = 0;
-        for (unsigned int b = 0; b < binCount_; b++)
+        for (unsigned int b = 0; b < MAX_BINS; b++)
             bins_[b] = 0;
         sampleCount_ = 0;
     }
@@ -33,8 +85,7 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         if (nClasses > MAX_BINS)
             throw std::runtime_error(exceptionString);
         binCount_ = nClasses;
-        bins_.resize(nClasses);
-        for (unsigned int b = 0; b < binCount_; b++)
+        for (unsigned int b = 0; b < MAX_BINS; b++)
             bins_[b] = 0;
         sampleCount_ = 0;
     }
@@ -88,16 +139,20 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         sampleCount_ += aggregator.sampleCount_;
     }
 
-    HistogramAggregator HistogramAggregator::DeepClone() const
+    void HistogramAggregator::Subtract(const HistogramAggregator& aggregator)
     {
-        HistogramAggregator result(BinCount());
+        assert(aggregator.BinCount() == BinCount());
 
         for (unsigned int b = 0; b < BinCount(); b++)
-            result.bins_[b] = bins_[b];
+            bins_[b] -= aggregator.bins_[b];
 
-        result.sampleCount_ = sampleCount_;
+        sampleCount_ -= aggregator.sampleCount_;
+    }
 
-        return result;
+    HistogramAggregator HistogramAggregator::DeepClone() const
+    {
+        // No heap storage, so a copy is a deep copy
+        return *this;
     }
     //////////// END IStatisticsAggregator implementation ////////////////
 
@@ -153,6 +208,27 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
     }
 
+    void DiffEntropyAggregator::Subtract(const DiffEntropyAggregator& aggregator)
+    {
+        // The pooled variance merge in Aggregate, solved for the remainder
+        int n = this->sample_count_ - aggregator.sample_count_;
+        if (n <= 0)
+        {
+            Clear();
+            return;
+        }
+
+        int total = this->sample_count_;
+        int m = aggregator.sample_count_;
+        float mean = this->mean_;
+        float mean2 = aggregator.mean_;
+        this->mean_ = ((total * mean) - (m * mean2)) / n;
+        this->sample_count_ = n;
+        float num = total * (this->var_ + (mean * mean)) - m * (aggregator.var_ + (mean2 * mean2));
+        this->var_ = std::max(0.0f, (num / n) - (this->mean_ * this->mean_));
+        this->sse_ = this->var_ * this->sample_count_;
+    }
+
     void DiffEntropyAggregator::Clear()
     {
         this->mean_ = 0;
@@ -185,4 +261,85 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         this->var_ = this->sse_ / (this->sample_count_ - 1);
     }
 
+    MomentsAggregator::MomentsAggregator()
+    {
+        Clear();
+    }
+
+    float MomentsAggregator::GetMean() const
+    {
+        if (sample_count_ == 0)
+            return 0.0f;
+
+        return (float)((double)sum_ / sample_count_);
+    }
+
+    double MomentsAggregator::SumSquaredError() const
+    {
+        if (sample_count_ == 0)
+            return 0.0;
+
+        // Only the final subtraction is inexact. Long double keeps the
+        // cancellation error small even at hundreds of millions of samples.
+        long double sum = (long double)sum_;
+        long double sse = (long double)sumSquares_ - sum * sum / sample_count_;
+
+        return sse > 0 ? (double)sse : 0.0;
+    }
+
+    double MomentsAggregator::Variance() const
+    {
+        if (sample_count_ < 2)
+            return 0.0;
+
+        return SumSquaredError() / (sample_count_ - 1);
+    }
+
+    double MomentsAggregator::DifferentialEntropy() const
+    {
+        double var = Variance();
+        if (var == 0.0)
+            return 0.0;
+
+        return log(sqrt(var));
+    }
+
+    //////////// IStatisticsAggregator implementation ////////////////
+    void MomentsAggregator::Clear()
+    {
+        sum_ = 0;
+        sumSquares_ = 0;
+        sample_count_ = 0;
+    }
+
+    void MomentsAggregator::Aggregate(const IDataPointCollection& data, unsigned int index)
+    {
+        const DataPointCollection& concreteData = (const DataPointCollection&)(data);
+
+        unsigned long long target = concreteData.GetTarget(index);
+        sum_ += target;
+        sumSquares_ += target * target;
+        sample_count_ += 1;
+    }
+
+    void MomentsAggregator::Aggregate(const MomentsAggregator& aggregator)
+    {
+        sum_ += aggregator.sum_;
+        sumSquares_ += aggregator.sumSquares_;
+        sample_count_ += aggregator.sample_count_;
+    }
+
+    void MomentsAggregator::Subtract(const MomentsAggregator& aggregator)
+    {
+        sum_ -= aggregator.sum_;
+        sumSquares_ -= aggregator.sumSquares_;
+        sample_count_ -= aggregator.sample_count_;
+    }
+
+    MomentsAggregator MomentsAggregator::DeepClone() const
+    {
+        return *this;
+    }
+    //////////// END IStatisticsAggregator implementation ////////////////
+
 }   }   }
\ No newline at end of file
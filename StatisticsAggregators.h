@@ -21,10 +21,13 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 {
     // Histogram Aggregator is used for classification problems
     // Should be able to deal with multi-dimensional data (I think)
+    // The bins are held inline, sized by MAX_BINS, so the aggregator is a
+    // plain value: copying one (into a Node, a partition or a clone)
+    // doesn't allocate, and a tree's nodes are one contiguous block.
     struct HistogramAggregator
     {
     public:
-        std::vector<unsigned int> bins_;
+        unsigned int bins_[MAX_BINS];
         unsigned int binCount_;
 
         unsigned int sampleCount_;
@@ -35,6 +38,24 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         /// </summary>
         double Entropy() const;
 
+        /// <summary>
+        /// Returns SampleCount() * Entropy(), worked out from the integer
+        /// counts as n log2 n - sum(c log2 c) using a lookup table, so it
+        /// needs no divisions and (for most counts) no logs
+        /// </summary>
+        double WeightedEntropy() const;
+
+        /// <summary>
+        /// n * log2(n), with 0 log2 0 taken as 0. Small n come from a
+        /// precomputed table.
+        /// </summary>
+        static double NLog2N(unsigned int n);
+
+        /// <summary>
+        /// Returns SampleCount() * Gini impurity, n - sum(c^2) / n
+        /// </summary>
+        double WeightedGini() const;
+
         /// <summary>
         /// Creates a HistogramAggregator instance with number of bins set to 0
         /// </summary>
@@ -61,6 +82,8 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
         void Aggregate(const HistogramAggregator& aggregator);
 
+        void Subtract(const HistogramAggregator& aggregator);
+
         HistogramAggregator DeepClone() const;
         //////////// END IStatisticsAggregator implementation ////////////////
     };
@@ -91,6 +114,11 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
         float GetMean() const { return mean_; }
 
+        /// <summary>
+        /// Sum of squared differences from the mean
+        /// </summary>
+        double SumSquaredError() const { return sse_; }
+
         //////////// IStatisticsAggregator implementation ////////////////
         void Clear();
 
@@ -98,6 +126,8 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
         void Aggregate(const DiffEntropyAggregator& aggregator);
 
+        void Subtract(const DiffEntropyAggregator& aggregator);
+
         DiffEntropyAggregator DeepClone() const;
         //////////// END IStatisticsAggregator implementation ////////////////
 
@@ -106,4 +136,54 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 
     };
 
+    // MomentsAggregator is an alternative to DiffEntropyAggregator holding
+    // the exact integer count, sum and sum of squares of the uint16 targets.
+    // Aggregating is a couple of integer adds and merging is exact, with the
+    // mean and variance only worked out when asked for. It serializes in the
+    // DiffEntropyAggregator format, so forests trained with it are read back
+    // as ordinary regression forests.
+    struct MomentsAggregator
+    {
+    public:
+        unsigned long long sum_;
+        unsigned long long sumSquares_;
+        unsigned int sample_count_;
+
+        /// <summary>
+        /// Returns the differential entropy, log of the standard deviation
+        /// </summary>
+        double DifferentialEntropy() const;
+
+        /// <summary>
+        /// Creates a MomentsAggregator instance with no samples
+        /// </summary>
+        MomentsAggregator();
+
+        unsigned int SampleCount() const { return sample_count_; }
+
+        float GetMean() const;
+
+        /// <summary>
+        /// Sum of squared differences from the mean
+        /// </summary>
+        double SumSquaredError() const;
+
+        /// <summary>
+        /// Sample variance, 0 for fewer than two samples
+        /// </summary>
+        double Variance() const;
+
+        //////////// IStatisticsAggregator implementation ////////////////
+        void Clear();
+
+        void Aggregate(const IDataPointCollection& data, unsigned int index);
+
+        void Aggregate(const MomentsAggregator& aggregator);
+
+        void Subtract(const MomentsAggregator& aggregator);
+
+        MomentsAggregator DeepClone() const;
+        //////////// END IStatisticsAggregator implementation ////////////////
+    };
+
 }   }   }
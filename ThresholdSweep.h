@@ -0,0 +1,42 @@
+#pragma once
+
+// This file defines SweepThresholds, which the serial and parallel trainers
+// use to score every candidate threshold of a feature in one pass.
+
+#include <vector>
+
+namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
+{
+  /// <summary>
+  /// Score every candidate threshold of a feature in one sweep. The right
+  /// hand statistics are suffix sums over the partitions and the left hand
+  /// ones grow by one partition per threshold, so this is O(nThresholds)
+  /// aggregations rather than O(nThresholds^2). Every caller folds the
+  /// partitions in the same order, so the gains don't depend on which
+  /// trainer or search asked for them.
+  /// </summary>
+  /// <param name="partitionStatistics">Statistics of the samples falling
+  /// in each of the nThresholds + 1 partitions.</param>
+  /// <param name="suffixStatistics">Scratch of at least nThresholds + 1.</param>
+  /// <param name="leftChildStatistics">Scratch for the left hand statistics.</param>
+  /// <param name="score">Called as score(t, left, right) for each threshold
+  /// t in ascending order.</param>
+  template<class S, class Score>
+  void SweepThresholds(const std::vector<S>& partitionStatistics, std::vector<S>& suffixStatistics,
+    S& leftChildStatistics, int nThresholds, Score score)
+  {
+    suffixStatistics[nThresholds] = partitionStatistics[nThresholds].DeepClone();
+    for (int p = nThresholds - 1; p > 0; p--)
+    {
+      suffixStatistics[p] = partitionStatistics[p].DeepClone();
+      suffixStatistics[p].Aggregate(suffixStatistics[p + 1]);
+    }
+
+    leftChildStatistics.Clear();
+    for (int t = 0; t < nThresholds; t++)
+    {
+      leftChildStatistics.Aggregate(partitionStatistics[t]);
+      score(t, leftChildStatistics, suffixStatistics[t + 1]);
+    }
+  }
+} } }
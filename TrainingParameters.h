@@ -7,6 +7,8 @@
 
 #include <vector>
 #include <string>
+#include <sstream>
+#include <stdexcept>
 #include <algorithm>
 #ifdef _OPENMP
 #include <omp.h>
@@ -15,6 +17,20 @@
 
 namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
 {
+  class SplitCriterionDescriptor
+  {
+  public:
+    enum e
+    {
+      // Shannon entropy for classification, differential entropy for regression
+      Entropy = 0,
+      // Gini impurity, classification only
+      Gini = 1,
+      // Variance reduction, regression only
+      Variance = 2
+    };
+  };
+
   /// <summary>
   /// Decision tree training parameters.
   /// </summary>
@@ -29,6 +45,17 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       MaxDecisionLevels = 5;
       Verbose = false;
       MaxThreads = omp_get_max_threads();     
+      RandomSeed = -1;
+      MaxSamplesPerNode = 0;
+      BagFraction = 1.0f;
+      BagBootstrap = false;
+      SplitCriterion = SplitCriterionDescriptor::Entropy;
+      PruneSampleSize = 0;
+      PruneFailureProbability = 0.001;
+      HalvingSampleSize = 0;
+      SharedFeaturePool = false;
+      FeatureBlockSize = 1;
+      StablePartition = false;
     }
 
     // Number of trees in a forest
@@ -43,6 +70,94 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     bool Verbose;
     // Maximum threads available for parallel training
     int MaxThreads;
+    // Seed for the forest's random number streams. The same seed grows the
+    // same forest whatever MaxThreads is. -1 seeds from the clock.
+    int RandomSeed;
+    // Nodes with more samples than this search for their split on a uniform
+    // subsample of this size; all samples are still used for the partition
+    // and for the node statistics. 0 searches on every sample.
+    unsigned int MaxSamplesPerNode;
+    // Fraction of the training images each tree is trained on, drawn per tree.
+    float BagFraction;
+    // Draw each tree's images with replacement (bootstrap) rather than without
+    bool BagBootstrap;
+    // Impurity measure the split search maximises the reduction of
+    SplitCriterionDescriptor::e SplitCriterion;
+    // If set, nodes with more than twice this many samples first score
+    // every candidate feature on a random sample of this size and skip the
+    // full evaluation of those scoring well below the best. This is a
+    // probabilistic heuristic, not a guarantee: the cutoff is a one-split
+    // Hoeffding interval applied to gains maximised over thresholds and
+    // candidates, so it may occasionally discard the true winner.
+    // 0 evaluates every candidate in full.
+    unsigned int PruneSampleSize;
+    // Sets the width of the pruning margin, nominally the chance that one
+    // candidate's single-split Hoeffding interval doesn't hold. The chance of
+    // pruning the winner isn't bounded by it.
+    double PruneFailureProbability;
+    // If set, the parallel trainer searches by successive halving: every
+    // candidate feature is scored on a random sample of this size, the
+    // better half are kept and scored on a sample twice the size, and so
+    // on until one is left or the sample is the whole node, when those
+    // left are evaluated in full. Replaces pruning. 0 evaluates every
+    // candidate in full.
+    unsigned int HalvingSampleSize;
+    // Train the tree a level at a time, every node of a level drawing its
+    // candidates from one pool of NumberOfCandidateFeatures features
+    // (parallel trainer only). MaxSamplesPerNode and FeatureBlockSize apply
+    // as usual, but PruneSampleSize and HalvingSampleSize can't be used with
+    // it.
+    bool SharedFeaturePool;
+    // Number of candidate features whose responses the parallel trainer
+    // computes in one pass over a node's samples. Larger blocks decode each
+    // sample less often but need a row of responses per feature per thread.
+    unsigned int FeatureBlockSize;
+    // Keep each node's samples in data point order (image by image, in
+    // raster order) when they're partitioned between its children, so
+    // deep nodes read their images sequentially. Changes which trees are
+    // grown, as samples are seen in a different order.
+    bool StablePartition;
+
+    /// <summary>
+    /// True if trees train on per-tree image bags rather than on all the data.
+    /// </summary>
+    bool Bagging() const
+    {
+      return BagFraction < 1.0f || BagBootstrap;
+    }
+
+    /// <summary>
+    /// Throws if the parameters ask for options that can't be combined.
+    /// </summary>
+    void Validate() const
+    {
+      if (SharedFeaturePool && (PruneSampleSize > 0 || HalvingSampleSize > 0))
+        throw std::runtime_error("SHARED_FEATURE_POOL can't be combined with PRUNE_SAMPLE or HALVING_SAMPLE");
+    }
+
+    /// <summary>
+    /// The parameters which decide what trees are grown, one per line.
+    /// MaxThreads and Verbose are left out, they don't change the trees.
+    /// </summary>
+    std::string Describe() const
+    {
+      std::ostringstream d;
+      d << "TREES " << NumberOfTrees << "\n"
+        << "CANDIDATE_FEATURES " << NumberOfCandidateFeatures << "\n"
+        << "THRESHOLDS_PER_FEATURE " << NumberOfCandidateThresholdsPerFeature << "\n"
+        << "LEVELS " << MaxDecisionLevels << "\n"
+        << "RANDOM_SEED " << RandomSeed << "\n"
+        << "NODE_SAMPLE_CAP " << MaxSamplesPerNode << "\n"
+        << "BAG_FRACTION " << BagFraction << "\n"
+        << "BAG_BOOTSTRAP " << BagBootstrap << "\n"
+        << "CRITERION " << SplitCriterion << "\n"
+        << "PRUNE_SAMPLE " << PruneSampleSize << " " << PruneFailureProbability << "\n"
+        << "HALVING_SAMPLE " << HalvingSampleSize << "\n"
+        << "SHARED_FEATURE_POOL " << SharedFeaturePool << "\n"
+        << "FEATURE_BLOCK " << FeatureBlockSize << "\n"
+        << "STABLE_PARTITION " << StablePartition << "\n";
+      return d.str();
+    }
   };
 
   class ForestDescriptor
@@ -63,7 +178,18 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     enum e
     {
       PixelDifference = 0,
-      RandomHyperplane = 1
+      RandomHyperplane = 1,
+      BoxDifference = 2
+    };
+  };
+
+  class RegressionStatisticsDescriptor
+  {
+  public:
+    enum e
+    {
+      DiffEntropy = 0,
+      Moments = 1
     };
   };
   ///<summary>
@@ -85,6 +211,8 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     int TrainingImagesStart;
     ForestDescriptor::e ForestType;
     SplitFunctionDescriptor::e SplitFunctionType;
+    // Statistics aggregator regression forests are trained with
+    RegressionStatisticsDescriptor::e RegressionStatistics;
     // for training an expert regressor
     int ExpertClassNo;
     // Depth raw is normalised, this'll always be false for 
@@ -106,6 +234,23 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     bool Webcam;
     // Majority of images within 0-300 mm?
     bool Closeup;
+    // If positive, keep only this many pixels from each training image,
+    // sampled evenly across the depth bins. 0 keeps every pixel.
+    int PixelsPerImage;
+    // If set, training data is kept in shard files in this directory and
+    // mapped from disk rather than held in memory. Empty keeps it in memory.
+    // The integral images SPLIT_FUNCTION BOX_DIFFERENCE needs are always
+    // built in memory, 4 bytes per pixel.
+    std::string ShardPath;
+    // Dataset cache file written by FTT -b. When it was built with the same
+    // data parameters, training maps it instead of decoding images.
+    std::string DatasetCache;
+    // For TYPE ALL, train the experts and classifier concurrently, one
+    // thread each, rather than one after another on all threads
+    bool ConcurrentForests;
+    // If set, each tree is saved in this directory as soon as it's trained
+    // and an interrupted build resumes from there. Empty disables it.
+    std::string CheckpointPath;
 
     ProgramParameters()
     {
@@ -118,6 +263,7 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       TrainingImagesStart = 0;
       ForestType = ForestDescriptor::Classification;
       SplitFunctionType = SplitFunctionDescriptor::PixelDifference;
+      RegressionStatistics = RegressionStatisticsDescriptor::DiffEntropy;
       ExpertClassNo = -1;
       DepthRaw = false;
       PatchSize = 25;
@@ -129,6 +275,8 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       Threshold = 38;
       Webcam = false;
       Closeup = true;
+      PixelsPerImage = 0;
+      ConcurrentForests = false;
     }
 
     bool setParam(std::string parameter, std::string value)
@@ -260,14 +408,154 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
           Tpr.MaxThreads = n;
         } 
       } 
+      else if(parameter.compare("RANDOM_SEED") == 0)
+      {
+        int n = std::stoi(value);
+        if(n < -1)
+          throw std::runtime_error("Random seed must be -1 (seed from clock) or non-negative");
+        Tpc.RandomSeed = n;
+        Tpr.RandomSeed = n;
+      }
+      else if(parameter.compare("NODE_SAMPLE_CAP") == 0)
+      {
+        int n = std::stoi(value);
+        if(n < 0)
+          throw std::runtime_error("Node sample cap must be 0 (no cap) or positive");
+        Tpc.MaxSamplesPerNode = n;
+        Tpr.MaxSamplesPerNode = n;
+      }
+      else if(parameter.compare("PRUNE_SAMPLE") == 0)
+      {
+        int n = std::stoi(value);
+        if(n < 0)
+          throw std::runtime_error("Prune sample must be 0 (no pruning) or positive");
+        Tpc.PruneSampleSize = n;
+        Tpr.PruneSampleSize = n;
+      }
+      else if(parameter.compare("HALVING_SAMPLE") == 0)
+      {
+        int n = std::stoi(value);
+        if(n < 0)
+          throw std::runtime_error("Halving sample must be 0 (no halving) or positive");
+        Tpc.HalvingSampleSize = n;
+        Tpr.HalvingSampleSize = n;
+      }
+      else if(parameter.compare("SHARED_FEATURE_POOL") == 0)
+      {
+        bool b;
+        if(value.compare("NO")==0)
+          b = false;
+        else if(value.compare("YES")==0)
+          b = true;
+        else
+          throw std::runtime_error("Invalid value for SHARED_FEATURE_POOL, expected YES or NO");
+        Tpc.SharedFeaturePool = b;
+        Tpr.SharedFeaturePool = b;
+      }
+      else if(parameter.compare("FEATURE_BLOCK") == 0)
+      {
+        int n = std::stoi(value);
+        if(n < 1)
+          throw std::runtime_error("Feature block size must be positive");
+        Tpc.FeatureBlockSize = n;
+        Tpr.FeatureBlockSize = n;
+      }
+      else if(parameter.compare("STABLE_PARTITION") == 0)
+      {
+        bool b;
+        if(value.compare("NO")==0)
+          b = false;
+        else if(value.compare("YES")==0)
+          b = true;
+        else
+          throw std::runtime_error("Invalid value for STABLE_PARTITION, expected YES or NO");
+        Tpc.StablePartition = b;
+        Tpr.StablePartition = b;
+      }
+      else if(parameter.compare("BAG_FRACTION") == 0)
+      {
+        float f = std::stof(value);
+        if(f <= 0.0f || f > 1.0f)
+          throw std::runtime_error("Bag fraction must be greater than 0 and at most 1");
+        Tpc.BagFraction = f;
+        Tpr.BagFraction = f;
+      }
+      else if(parameter.compare("CLASS_CRITERION") == 0)
+      {
+        if(value.compare("ENTROPY") == 0)
+          Tpc.SplitCriterion = SplitCriterionDescriptor::Entropy;
+        else if(value.compare("GINI") == 0)
+          Tpc.SplitCriterion = SplitCriterionDescriptor::Gini;
+        else
+          throw std::runtime_error("Invalid value for CLASS_CRITERION, accepted values are ENTROPY and GINI");
+      }
+      else if(parameter.compare("REG_CRITERION") == 0)
+      {
+        if(value.compare("ENTROPY") == 0)
+          Tpr.SplitCriterion = SplitCriterionDescriptor::Entropy;
+        else if(value.compare("VARIANCE") == 0)
+          Tpr.SplitCriterion = SplitCriterionDescriptor::Variance;
+        else
+          throw std::runtime_error("Invalid value for REG_CRITERION, accepted values are ENTROPY and VARIANCE");
+      }
+      else if(parameter.compare("BAG_BOOTSTRAP") == 0)
+      {
+        bool b;
+        if(value.compare("NO")==0)
+          b = false;
+        else if(value.compare("YES")==0)
+          b = true;
+        else
+          throw std::runtime_error("Invalid value for BAG_BOOTSTRAP, expected YES or NO");
+        Tpc.BagBootstrap = b;
+        Tpr.BagBootstrap = b;
+      }
       else if(parameter.compare("SPLIT_FUNCTION")==0)
       {
         if(value.compare("PIXEL_DIFFERENCE") == 0)
           SplitFunctionType = SplitFunctionDescriptor::PixelDifference;
         else if(value.compare("RANDOM_HYPERPLANE")==0)
           SplitFunctionType = SplitFunctionDescriptor::RandomHyperplane;
+        else if(value.compare("BOX_DIFFERENCE")==0)
+          SplitFunctionType = SplitFunctionDescriptor::BoxDifference;
         else
-          throw std::runtime_error("Invalid value for SPLIT_FUNCTION, accepted values are PIXEL_DIFFERENCE and RANDOM_HYPERPLANE");
+          throw std::runtime_error("Invalid value for SPLIT_FUNCTION, accepted values are PIXEL_DIFFERENCE, RANDOM_HYPERPLANE and BOX_DIFFERENCE");
+      }
+      else if(parameter.compare("REGRESSION_STATISTICS")==0)
+      {
+        if(value.compare("DIFF_ENTROPY")==0)
+          RegressionStatistics = RegressionStatisticsDescriptor::DiffEntropy;
+        else if(value.compare("MOMENTS")==0)
+          RegressionStatistics = RegressionStatisticsDescriptor::Moments;
+        else
+          throw std::runtime_error("Invalid value for REGRESSION_STATISTICS, accepted values are DIFF_ENTROPY and MOMENTS");
+      }
+      else if(parameter.compare("SHARD_PATH")==0)
+      {
+        if(IPUtils::dirExists(value))
+          ShardPath = value;
+        else
+          throw std::runtime_error("shard path not found");
+      }
+      else if(parameter.compare("CHECKPOINT_PATH")==0)
+      {
+        if(IPUtils::dirExists(value))
+          CheckpointPath = value;
+        else
+          throw std::runtime_error("checkpoint path not found");
+      }
+      else if(parameter.compare("DATASET_CACHE")==0)
+      {
+        DatasetCache = value;
+      }
+      else if(parameter.compare("CONCURRENT_FORESTS") == 0)
+      {
+        if(value.compare("YES") == 0)
+          ConcurrentForests = true;
+        else if(value.compare("NO") == 0)
+          ConcurrentForests = false;
+        else
+          throw std::runtime_error("Invalid value for CONCURRENT_FORESTS, expected YES or NO");
       }
       else if(parameter.compare("FOREST_OUTPUT")==0)
       {
@@ -319,6 +607,13 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         else
           Webcam = false;
       }
+      else if(parameter.compare("PIXELS_PER_IMAGE") == 0)
+      {
+        int n = std::stoi(value);
+        if(n < 0)
+          throw std::runtime_error("Pixels per image must be 0 (all pixels) or positive");
+        PixelsPerImage = n;
+      }
       else if(parameter.compare("IGNORE_CLOSE") == 0)
       {
         if(value.compare("YES")==0)
@@ -335,12 +630,17 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
     void prettyPrint()
     {
       std::string forestTypes [] = {"Classification", "Regression", "ExpertRegressor", "All"};
-      std::string splitTypes [] = {"Pixel Difference Response", "Random Hyperplane Response"};
+      std::string splitTypes [] = {"Pixel Difference Response", "Random Hyperplane Response", "Box Difference Response"};
+      std::string regressionStatistics [] = {"Differential Entropy", "Integer Moments"};
+      std::string criteria [] = {"Entropy", "Gini impurity", "Variance reduction"};
 
       std::cout << "Program Parameters:" << std::endl;
       std::cout << std::endl;
       std::cout << "Forest Type: \t\t\t" << forestTypes[ForestType] << std::endl;
       std::cout << "Split Function Type: \t\t" << splitTypes[SplitFunctionType] << std::endl;
+      std::cout << "Regression statistics: \t\t" << regressionStatistics[RegressionStatistics] << std::endl;
+      std::cout << "Classification criterion: \t" << criteria[Tpc.SplitCriterion] << std::endl;
+      std::cout << "Regression criterion: \t\t" << criteria[Tpr.SplitCriterion] << std::endl;
       std::cout << "Number of bins: \t\t" << std::to_string(Bins) << std::endl;
       std::cout << "Training images path: \t\t" << TrainingImagesPath << std::endl;
       std::cout << "Training images file prefix: \t" << InputPrefix << std::endl;
@@ -363,7 +663,20 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       std::cout << "Train on zero IR: \t\t" << (TrainOnZeroIR? "Yes" : "no") << std::endl;
       std::cout << "IR threshold value: \t\t" << std::to_string(Threshold) << std::endl;
       std::cout << "Webcam? \t\t\t" << (Webcam? "Yes" : "No") << std::endl;
+      std::cout << "Training data shards: \t\t" << (ShardPath.empty() ? "In memory" : ShardPath) << std::endl;
+      std::cout << "Dataset cache: \t\t\t" << (DatasetCache.empty() ? "None" : DatasetCache) << std::endl;
+      std::cout << "Tree checkpoints: \t\t" << (CheckpointPath.empty() ? "None" : CheckpointPath) << std::endl;
+      std::cout << "Pixels per image: \t\t" << (PixelsPerImage == 0 ? "All" : std::to_string(PixelsPerImage)) << std::endl;
       std::cout << "Max threads to use: \t\t" << std::to_string(Tpr.MaxThreads) << std::endl;
+      std::cout << "Concurrent forests: \t\t" << (ConcurrentForests? "Yes" : "No") << std::endl;
+      std::cout << "Node sample cap: \t\t" << (Tpr.MaxSamplesPerNode == 0 ? "None" : std::to_string(Tpr.MaxSamplesPerNode)) << std::endl;
+      std::cout << "Feature pruning sample: \t" << (Tpr.PruneSampleSize == 0 ? "None" : std::to_string(Tpr.PruneSampleSize)) << std::endl;
+      std::cout << "Halving search sample: \t" << (Tpr.HalvingSampleSize == 0 ? "None" : std::to_string(Tpr.HalvingSampleSize)) << std::endl;
+      std::cout << "Shared feature pool: \t\t" << (Tpr.SharedFeaturePool? "Yes" : "no") << std::endl;
+      std::cout << "Feature block size: \t\t" << Tpr.FeatureBlockSize << std::endl;
+      std::cout << "Stable partition: \t\t" << (Tpr.StablePartition? "Yes" : "no") << std::endl;
+      std::cout << "Image bag per tree: \t\t" << (Tpr.Bagging() ? std::to_string(Tpr.BagFraction) + (Tpr.BagBootstrap ? " (with replacement)" : "") : "All images") << std::endl;
+      std::cout << "Random seed: \t\t\t" << (Tpr.RandomSeed < 0 ? "From clock" : std::to_string(Tpr.RandomSeed)) << std::endl;
       
 
     }
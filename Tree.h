@@ -7,6 +7,7 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <stdexcept>
 #ifdef _OPENMP
 #include <omp.h>
@@ -164,7 +165,13 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       return nodes_[index];
     }
 
-    static DataPointIndex Partition(std::vector<float>& keys, std::vector<unsigned int>& values, DataPointIndex i0, DataPointIndex i1, float threshold)
+    /// <summary>
+    /// Reorder keys[i0..i1) and values[i0..i1) together so that those with
+    /// keys below the threshold come first.
+    /// </summary>
+    /// <returns>The index of the first key >= threshold.</returns>
+    template<class K>
+    static DataPointIndex Partition(std::vector<K>& keys, std::vector<unsigned int>& values, DataPointIndex i0, DataPointIndex i1, float threshold)
     {
       assert(i1 > i0); // past-the-end element index must be greater than start element index.
 
@@ -176,7 +183,7 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
         if (keys[i] >= threshold)
         {
           // Swap keys[i] with keys[j]
-          float key = keys[i];
+          K key = keys[i];
           unsigned int value = values[i];
 
           keys[i] = keys[j];
@@ -196,6 +203,236 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       return keys[i] >= threshold ? i : i + 1;
     }
 
+    /// <summary>
+    /// Partition() without a data dependent branch: each element is swapped
+    /// with the first element not yet known to be below the threshold, and
+    /// that position only advances if the element was below it. In place,
+    /// but elements end up in a different order from Partition()'s, so it's
+    /// used where that doesn't matter, e.g. by Apply().
+    /// </summary>
+    /// <returns>The index of the first key >= threshold.</returns>
+    template<class K>
+    static DataPointIndex BranchlessPartition(std::vector<K>& keys, std::vector<unsigned int>& values, DataPointIndex i0, DataPointIndex i1, float threshold)
+    {
+      // keys[i0..ii) are below the threshold, keys[ii..i) aren't
+      DataPointIndex ii = i0;
+      for (DataPointIndex i = i0; i < i1; i++)
+      {
+        K key = keys[i];
+        unsigned int value = values[i];
+
+        keys[i] = keys[ii];
+        values[i] = values[ii];
+        keys[ii] = key;
+        values[ii] = value;
+
+        ii += key < threshold ? 1 : 0;
+      }
+
+      return ii;
+    }
+
+    /// <summary>
+    /// Partition() that keeps keys and values in their original order on
+    /// each side of the threshold, so samples stored in order (by image and
+    /// position, say) stay in order. The keys and values >= the threshold
+    /// are moved through the scratch vectors.
+    /// </summary>
+    /// <returns>The index of the first key >= threshold.</returns>
+    template<class K>
+    static DataPointIndex StablePartition(std::vector<K>& keys, std::vector<unsigned int>& values, DataPointIndex i0, DataPointIndex i1, float threshold,
+      std::vector<K>& keyScratch, std::vector<unsigned int>& valueScratch)
+    {
+      assert(i1 > i0); // past-the-end element index must be greater than start element index.
+
+      if (keyScratch.size() < i1 - i0)
+        keyScratch.resize(i1 - i0);
+      if (valueScratch.size() < i1 - i0)
+        valueScratch.resize(i1 - i0);
+
+      // Compress-store: every element is written to both sides and only
+      // the side it belongs to advances, so there's no branch to mispredict
+      DataPointIndex ii = i0;
+      DataPointIndex right = 0;
+      for (DataPointIndex i = i0; i < i1; i++)
+      {
+        K key = keys[i];
+        unsigned int value = values[i];
+        DataPointIndex below = key < threshold ? 1 : 0;
+
+        keys[ii] = key;
+        values[ii] = value;
+        keyScratch[right] = key;
+        valueScratch[right] = value;
+
+        ii += below;
+        right += 1 - below;
+      }
+
+      std::copy(keyScratch.begin(), keyScratch.begin() + right, keys.begin() + ii);
+      std::copy(valueScratch.begin(), valueScratch.begin() + right, values.begin() + ii);
+
+      return ii;
+    }
+
+    // Ranges at least this long are worth partitioning on several threads
+    static const DataPointIndex ParallelPartitionSize = 1 << 16;
+
+    /// <summary>
+    /// StablePartition() shared between up to threadCount threads, for
+    /// ranges of at least ParallelPartitionSize. The range is split into a
+    /// block per thread. Each block counts its keys below the threshold, a
+    /// prefix sum of the counts tells each block where its keys go, and the
+    /// blocks are then moved into the scratch vectors, and back, in
+    /// parallel. The result is StablePartition()'s, whatever threadCount is.
+    /// </summary>
+    /// <returns>The index of the first key >= threshold.</returns>
+    template<class K>
+    static DataPointIndex ParallelPartition(std::vector<K>& keys, std::vector<unsigned int>& values, DataPointIndex i0, DataPointIndex i1, float threshold,
+      std::vector<K>& keyScratch, std::vector<unsigned int>& valueScratch, int threadCount)
+    {
+      assert(i1 > i0); // past-the-end element index must be greater than start element index.
+
+#ifdef _OPENMP
+      DataPointIndex n = i1 - i0;
+      if (threadCount < 2 || n < ParallelPartitionSize)
+        return StablePartition(keys, values, i0, i1, threshold, keyScratch, valueScratch);
+
+      if (keyScratch.size() < n)
+        keyScratch.resize(n);
+      if (valueScratch.size() < n)
+        valueScratch.resize(n);
+
+      int blocks = threadCount;
+      DataPointIndex blockSize = (n + blocks - 1) / blocks;
+
+      // leftBefore[b] is the number of keys below the threshold in blocks before b
+      std::vector<DataPointIndex> leftBefore(blocks + 1, 0);
+      #pragma omp parallel for num_threads(threadCount)
+      for (int b = 0; b < blocks; b++)
+      {
+        DataPointIndex b0 = i0 + std::min(n, b * blockSize), b1 = i0 + std::min(n, (b + 1) * blockSize);
+        DataPointIndex below = 0;
+        for (DataPointIndex i = b0; i < b1; i++)
+          below += keys[i] < threshold ? 1 : 0;
+        leftBefore[b + 1] = below;
+      }
+      for (int b = 0; b < blocks; b++)
+        leftBefore[b + 1] += leftBefore[b];
+      DataPointIndex left = leftBefore[blocks];
+
+      #pragma omp parallel for num_threads(threadCount)
+      for (int b = 0; b < blocks; b++)
+      {
+        DataPointIndex b0 = i0 + std::min(n, b * blockSize), b1 = i0 + std::min(n, (b + 1) * blockSize);
+        DataPointIndex l = leftBefore[b];
+        DataPointIndex r = left + (b0 - i0) - leftBefore[b];
+        for (DataPointIndex i = b0; i < b1; i++)
+        {
+          DataPointIndex below = keys[i] < threshold ? 1 : 0;
+          DataPointIndex d = below ? l : r;
+          keyScratch[d] = keys[i];
+          valueScratch[d] = values[i];
+          l += below;
+          r += 1 - below;
+        }
+      }
+
+      #pragma omp parallel for num_threads(threadCount)
+      for (int b = 0; b < blocks; b++)
+      {
+        DataPointIndex b0 = std::min(n, b * blockSize), b1 = std::min(n, (b + 1) * blockSize);
+        std::copy(keyScratch.begin() + b0, keyScratch.begin() + b1, keys.begin() + i0 + b0);
+        std::copy(valueScratch.begin() + b0, valueScratch.begin() + b1, values.begin() + i0 + b0);
+      }
+
+      return i0 + left;
+#else
+      return StablePartition(keys, values, i0, i1, threshold, keyScratch, valueScratch);
+#endif
+    }
+
+    /// <summary>
+    /// BranchlessPartition() shared between up to threadCount threads, for
+    /// ranges of at least ParallelPartitionSize. Each thread partitions a
+    /// block of the range in place. The keys >= threshold left of where the
+    /// split will be are then swapped, in parallel, with the keys below it
+    /// right of the split, so no scratch storage is needed. The order of
+    /// the result depends on threadCount.
+    /// </summary>
+    /// <returns>The index of the first key >= threshold.</returns>
+    template<class K>
+    static DataPointIndex ParallelInPlacePartition(std::vector<K>& keys, std::vector<unsigned int>& values, DataPointIndex i0, DataPointIndex i1, float threshold, int threadCount)
+    {
+#ifdef _OPENMP
+      DataPointIndex n = i1 - i0;
+      if (threadCount < 2 || n < ParallelPartitionSize)
+        return BranchlessPartition(keys, values, i0, i1, threshold);
+
+      int blocks = threadCount;
+      DataPointIndex blockSize = (n + blocks - 1) / blocks;
+
+      // split[b] is where block b's keys >= threshold start
+      std::vector<DataPointIndex> split(blocks);
+      #pragma omp parallel for num_threads(threadCount)
+      for (int b = 0; b < blocks; b++)
+      {
+        DataPointIndex b0 = i0 + std::min(n, b * blockSize), b1 = i0 + std::min(n, (b + 1) * blockSize);
+        split[b] = BranchlessPartition(keys, values, b0, b1, threshold);
+      }
+
+      DataPointIndex ii = i0;
+      for (int b = 0; b < blocks; b++)
+        ii += split[b] - (i0 + std::min(n, b * blockSize));
+
+      // Runs of keys on the wrong side of ii: those >= threshold before it
+      // and those below it after it. There are as many of each.
+      std::vector<std::pair<DataPointIndex, DataPointIndex> > high, low;
+      DataPointIndex misplaced = 0;
+      for (int b = 0; b < blocks; b++)
+      {
+        DataPointIndex b0 = i0 + std::min(n, b * blockSize), b1 = i0 + std::min(n, (b + 1) * blockSize);
+        if (split[b] < std::min(b1, ii))
+        {
+          high.push_back(std::make_pair(split[b], std::min(b1, ii)));
+          misplaced += std::min(b1, ii) - split[b];
+        }
+        if (std::max(b0, ii) < split[b])
+          low.push_back(std::make_pair(std::max(b0, ii), split[b]));
+      }
+
+      // Thread t swaps the misplaced keys ranked [r0, r1) on each side
+      #pragma omp parallel for num_threads(threadCount)
+      for (int t = 0; t < threadCount; t++)
+      {
+        DataPointIndex r0 = misplaced * t / threadCount, r1 = misplaced * (t + 1) / threadCount;
+        if (r0 == r1)
+          continue;
+
+        size_t h = 0, l = 0;
+        DataPointIndex hi = high[0].first + r0, li = low[0].first + r0;
+        while (hi >= high[h].second)
+          hi = high[h + 1].first + (hi - high[h].second), h++;
+        while (li >= low[l].second)
+          li = low[l + 1].first + (li - low[l].second), l++;
+
+        for (DataPointIndex r = r0; r < r1; r++)
+        {
+          std::swap(keys[hi], keys[li]);
+          std::swap(values[hi], values[li]);
+          if (++hi == high[h].second && h + 1 < high.size())
+            hi = high[++h].first;
+          if (++li == low[l].second && l + 1 < low.size())
+            li = low[++l].first;
+        }
+      }
+
+      return ii;
+#else
+      return BranchlessPartition(keys, values, i0, i1, threshold);
+#endif
+    }
+
     void CheckValid() const
     {
       if(NodeCount()==0)
@@ -282,7 +519,7 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       responses_[i] = node.Feature.GetResponse(data, dataIndices[i]);
     }
 
-      int ii = Partition(responses_, dataIndices, i0, i1, node.Threshold);
+      int ii = (int)BranchlessPartition(responses_, dataIndices, i0, i1, node.Threshold);
 
       // Recurse for child nodes.
       ApplyNode(nodeIndex * 2 + 1, data, dataIndices, i0, ii, leafNodeIndices, responses_);
@@ -319,7 +556,8 @@ namespace MicrosoftResearch { namespace Cambridge { namespace Sherwood
       responses_[i] = node.Feature.GetResponse(data, dataIndices[i]);
     }
 
-    int ii = Partition(responses_, dataIndices, i0, i1, node.Threshold);
+    // Large ranges, near the root, are partitioned on every thread
+    int ii = (int)ParallelInPlacePartition(responses_, dataIndices, i0, i1, node.Threshold, max_threads);
 
     // Recurse for child nodes.
     ApplyNodeParallel(nodeIndex * 2 + 1, data, dataIndices, i0, ii, leafNodeIndices, responses_);